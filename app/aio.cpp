@@ -0,0 +1,145 @@
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "io_ring.hpp"
+#include "dbg.hpp"
+#include "enclave_u.h"
+
+/* Asynchronous block I/O on a pool of untrusted worker threads.
+   Linux AIO on table files opened without O_DIRECT completes inside
+   io_submit, so the workers do plain positional I/O instead. The
+   pool starts on first use and lives as long as the process, so its
+   state is statically initialized and never destroyed: the detached
+   workers are still waiting on it when the process exits. */
+
+#define AIO_QUEUE_LEN (IO_AIO_CTXS * IO_AIO_DEPTH)
+
+typedef struct aio_work {
+	int ctx;
+	io_req_t req;
+} aio_work_t;
+
+/* Requests not yet picked up by a worker, of all contexts. A context
+   has at most IO_AIO_DEPTH requests in flight, so it never overflows */
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aio_cv = PTHREAD_COND_INITIALIZER;
+static aio_work_t aio_queue[AIO_QUEUE_LEN];
+static int aio_head, aio_len;
+
+/* Completions of one context, waiting to be reaped */
+typedef struct aio_ctx {
+	pthread_cond_t cv;
+	io_cpl_t cpls[IO_AIO_DEPTH];
+	int head, ncpls;
+	int inflight; /* submitted and not reaped yet */
+} aio_ctx_t;
+
+static aio_ctx_t aio_ctxs[IO_AIO_CTXS];
+static pthread_once_t aio_once = PTHREAD_ONCE_INIT;
+static int aio_nworkers;
+
+static void *aio_worker(void *arg)
+{
+	aio_work_t w;
+	io_cpl_t cpl;
+	aio_ctx_t *c;
+
+	while (true) {
+		pthread_mutex_lock(&aio_lock);
+		while (!aio_len)
+			pthread_cond_wait(&aio_cv, &aio_lock);
+		w = aio_queue[aio_head];
+		aio_head = (aio_head + 1) % AIO_QUEUE_LEN;
+		aio_len--;
+		pthread_mutex_unlock(&aio_lock);
+
+		cpl.id = w.req.id;
+		cpl.result = w.req.op == IO_OP_READ ?
+			ocall_pread_block(w.req.fd, w.req.buf, w.req.size, w.req.offset) :
+			ocall_pwrite_block(w.req.fd, w.req.buf, w.req.size, w.req.offset);
+
+		c = &aio_ctxs[w.ctx];
+		pthread_mutex_lock(&aio_lock);
+		c->cpls[(c->head + c->ncpls) % IO_AIO_DEPTH] = cpl;
+		c->ncpls++;
+		pthread_cond_signal(&c->cv);
+		pthread_mutex_unlock(&aio_lock);
+	}
+	return NULL;
+}
+
+static void aio_start()
+{
+	pthread_t t;
+
+	for (int i = 0; i < IO_AIO_CTXS; i++)
+		pthread_cond_init(&aio_ctxs[i].cv, NULL);
+
+	for (int i = 0; i < IO_AIO_WORKERS; i++) {
+		if (pthread_create(&t, NULL, aio_worker, NULL)) {
+			ERR("failed to start aio worker\n");
+			break;
+		}
+		pthread_detach(t);
+		aio_nworkers++;
+	}
+}
+
+/* Queue a batch of requests for the workers and return without
+   waiting for them. Returns n, or -1 if nothing was submitted and
+   the caller should do the I/O synchronously */
+int ocall_aio_submit(int ctx, io_req_t *reqs, int n)
+{
+	pthread_once(&aio_once, aio_start);
+
+	if (!aio_nworkers || ctx < 0 || ctx >= IO_AIO_CTXS || n <= 0 || n > IO_AIO_DEPTH)
+		return -1;
+
+	pthread_mutex_lock(&aio_lock);
+	if (aio_ctxs[ctx].inflight + n > IO_AIO_DEPTH) {
+		pthread_mutex_unlock(&aio_lock);
+		return -1;
+	}
+	aio_ctxs[ctx].inflight += n;
+
+	for (int i = 0; i < n; i++) {
+		aio_queue[(aio_head + aio_len) % AIO_QUEUE_LEN] = {ctx, reqs[i]};
+		aio_len++;
+	}
+	pthread_cond_broadcast(&aio_cv);
+	pthread_mutex_unlock(&aio_lock);
+	return n;
+}
+
+/* Wait for at least min completions, min can be 0 to only collect
+   what is done. Returns how many were stored in cpls or -1 */
+int ocall_aio_reap(int ctx, io_cpl_t *cpls, int min, int max)
+{
+	aio_ctx_t *c;
+	int n = 0;
+
+	if (ctx < 0 || ctx >= IO_AIO_CTXS || min < 0 || max > IO_AIO_DEPTH || min > max)
+		return -1;
+
+	c = &aio_ctxs[ctx];
+	pthread_mutex_lock(&aio_lock);
+
+	/* Don't wait for requests that were never submitted */
+	if (min > c->inflight) {
+		pthread_mutex_unlock(&aio_lock);
+		return -1;
+	}
+
+	while (c->ncpls < min)
+		pthread_cond_wait(&c->cv, &aio_lock);
+
+	while (n < max && c->ncpls) {
+		cpls[n++] = c->cpls[c->head];
+		c->head = (c->head + 1) % IO_AIO_DEPTH;
+		c->ncpls--;
+	}
+	c->inflight -= n;
+	pthread_mutex_unlock(&aio_lock);
+	return n;
+}
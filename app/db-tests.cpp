@@ -5,11 +5,13 @@
 #include <fstream>
 #include <sstream>
 #include "enclave_u.h" // Headers for untrusted part (autogenerated by edger8r)
+#include "io_ring.hpp"
 #include <time.hpp>
 #include <thread>
 #include <cassert>
 #include <vector>
 #include <assert.h>
+#include <cerrno>
 
 using namespace std;
 #define OCALL_TEST_LENGTH 10000
@@ -20,6 +22,8 @@ using namespace std;
 
 #define RANDINT_TABLE_SIZE	256
 
+#define INSERT_BATCH_ROWS	1024 /* Rows per ecall_insert_rows() */
+
 #define NUM_ELEMENTS(x) (sizeof(x)/sizeof(x[0]))
 schema_type_t uvisits_type_arr[] = { TINYTEXT, TINYTEXT, INTEGER, INTEGER, TINYTEXT, TINYTEXT, TINYTEXT, TINYTEXT, INTEGER };
 schema_type_t rankings_type_arr[] = { TINYTEXT, INTEGER, INTEGER };
@@ -49,18 +53,25 @@ constexpr schema_t derive_schema(schema_type_t *type_arr, int num_types) {
 int populate_database_from_csv(std::string fname, int num_rows, int db_id, int
 		table_id, schema_t *sc, sgx_enclave_id_t eid)
 {
-	uint8_t *row;
+	uint8_t *rows, *row;
 	char data[MAX_ROW_SIZE];
 	char line[MAX_ROW_SIZE];
+	unsigned long long start, end;
+	int batch = 0;
 	int sgx_ret;
 	int ret;
 
 	std::ifstream file(fname);
 
-	row = (uint8_t*)malloc(MAX_ROW_SIZE);
+	/* Rows are packed back to back and handed over a batch at a time */
+	rows = (uint8_t*)malloc(INSERT_BATCH_ROWS * sc->row_data_size);
+	if (!rows)
+		return -ENOMEM;
 
+	start = RDTSC_START();
 	for (auto i = 0u; i < num_rows; i++) {
-		memset(row, 0x0, MAX_ROW_SIZE);
+		row = &rows[batch * sc->row_data_size];
+		memset(row, 0x0, sc->row_data_size);
 		file.getline(line, MAX_ROW_SIZE);
 
 		std::istringstream ss(line);
@@ -74,23 +85,32 @@ int populate_database_from_csv(std::string fname, int num_rows, int db_id, int
 				d = atoi(data);
 				memcpy(&row[sc->offsets[j]], &d, 4);
 			} else if (sc->types[j] == TINYTEXT) {
-				strncpy((char*)&row[sc->offsets[j]], data, strlen(data) + 1);
+				strncpy((char*)&row[sc->offsets[j]], data, sc->sizes[j] - 1);
 			}
 		}
 
-		sgx_ret = ecall_insert_row_dbg(eid, &ret, db_id, table_id, row);
+		if (++batch < INSERT_BATCH_ROWS && i + 1 < num_rows)
+			continue;
+
+		sgx_ret = ecall_insert_rows(eid, &ret, db_id, table_id, rows,
+			sc->row_data_size, batch);
 
 		if (sgx_ret || ret) {
-			ERR("insert row:%d from %s, err:%d (sgx ret:%d)\n",
-				i, fname.c_str(), ret, sgx_ret);
+			ERR("insert rows:%d-%d from %s, err:%d (sgx ret:%d)\n",
+				i + 1 - batch, i, fname.c_str(), ret, sgx_ret);
 			goto cleanup;
 		}
-
+		batch = 0;
 	}
+	end = RDTSCP();
+
+	printf("Loaded %d rows from %s in %llu cycles (%llu cycles/row, %f rows/sec)\n",
+		num_rows, fname.c_str(), end - start, 
+		num_rows ? (end - start) / num_rows : 0,
+		num_rows / ((end - start) / cycles_per_sec));
 	ret = 0;
 cleanup:
-	if (row)
-		free(row);
+	free(rows);
 
 	return ret;
 }
@@ -240,6 +260,89 @@ void run_rankings_test(sgx_enclave_id_t eid, int db_id, int rankings_table_id)
 	ecall_print_table_dbg(eid, &ret, db_id, rankings_table_id, 0, 23);
 }
 
+#if defined(TEST_IO_RING)
+/* Time full table scans with block I/O done by ocalls and through 
+   the exitless I/O ring */
+void test_io_ring_scans(sgx_enclave_id_t eid, int db_id, int table_id, const char *name)
+{
+	unsigned long long start, end;
+	io_ring_t *ring;
+	int ret;
+
+	start = RDTSC_START();
+	ecall_scan_table_dbg(eid, &ret, db_id, table_id);
+	end = RDTSCP();
+	printf("Scan of %s with ocall I/O took %llu cycles (%f sec)\n", 
+		name, end - start, (end - start) / cycles_per_sec);
+
+	ring = io_ring_start(IO_RING_WORKERS);
+	if (!ring)
+		return;
+	ecall_io_ring_attach(eid, &ret, db_id, ring);
+
+	start = RDTSC_START();
+	ecall_scan_table_dbg(eid, &ret, db_id, table_id);
+	end = RDTSCP();
+	printf("Scan of %s with io ring I/O took %llu cycles (%f sec)\n", 
+		name, end - start, (end - start) / cycles_per_sec);
+
+	ecall_io_ring_attach(eid, &ret, db_id, NULL);
+	io_ring_stop(ring);
+}
+#endif
+
+#if defined(TEST_FRESHNESS)
+/* Time a cold scan. The overhead of the freshness checks is the 
+   difference to the same scan in a build without BLOCK_FRESHNESS */
+void test_freshness_scans(sgx_enclave_id_t eid, int db_id, int table_id, const char *name, unsigned long rows)
+{
+	unsigned long long start, end, cycles;
+	int ret;
+
+	ecall_merkle_scan_setup(eid, &ret, db_id, table_id);
+	if (ret) {
+		ERR("merkle scan setup failed:%d\n", ret);
+		return;
+	}
+
+	start = RDTSC_START();
+	ecall_scan_table_dbg(eid, &ret, db_id, table_id);
+	end = RDTSCP();
+	cycles = end - start;
+
+#if defined(BLOCK_FRESHNESS)
+	printf("Scan of %s with freshness checks took %llu cycles (%f sec, %llu cycles/row)\n", 
+		name, cycles, cycles / cycles_per_sec, cycles / rows);
+
+	/* Prints the stats of the scan */
+	ecall_merkle_scan_setup(eid, &ret, db_id, table_id);
+#else
+	printf("Scan of %s without freshness checks took %llu cycles (%f sec, %llu cycles/row)\n", 
+		name, cycles, cycles / cycles_per_sec, cycles / rows);
+#endif
+}
+#endif
+
+#if defined(BCACHE_FLUSHER)
+void bcache_flusher_fn(sgx_enclave_id_t eid, int db_id)
+{
+	int ret;
+	ecall_bcache_flusher(eid, &ret, db_id);
+}
+
+void bcache_flusher_stop(sgx_enclave_id_t eid, int db_id, thread *flusher)
+{
+	int ret;
+
+	/* The flusher thread might not have entered the enclave yet */
+	do {
+		ecall_bcache_flusher_stop(eid, &ret, db_id);
+	} while (ret == -EAGAIN);
+
+	flusher->join();
+}
+#endif
+
 int test_rankings(sgx_enclave_id_t eid) {
  	
 	schema_t sc, sc_udata;
@@ -255,7 +358,7 @@ int test_rankings(sgx_enclave_id_t eid) {
 
 	sc = derive_schema(rankings_type_arr, NUM_ELEMENTS(rankings_type_arr));
 
-	sgx_ret = ecall_create_db(eid, &ret, db_name.c_str(), db_name.length(), &db_id);
+	sgx_ret = ecall_create_db(eid, &ret, db_name.c_str(), db_name.length(), 0, 0, &db_id);
 	if (sgx_ret || ret) {
 		ERR("create db error:%d (sgx ret:%d)\n", ret, sgx_ret);
 		return ret; 
@@ -309,6 +412,16 @@ int test_rankings(sgx_enclave_id_t eid) {
 	}
 #endif
 
+#if defined(TEST_IO_RING)
+	test_io_ring_scans(eid, db_id, rankings_table_id, "rankings");
+	test_io_ring_scans(eid, db_id, udata_table_id, "uservisits");
+#endif
+
+#if defined(TEST_FRESHNESS)
+	test_freshness_scans(eid, db_id, rankings_table_id, "rankings", RANKINGS_TABLE_SIZE);
+	test_freshness_scans(eid, db_id, udata_table_id, "uservisits", UVISITS_TABLE_SIZE);
+#endif
+
 #if defined(TEST_BCACHE)
 	/* Buffer cache testst */
 	{	
@@ -354,6 +467,10 @@ int test_rankings(sgx_enclave_id_t eid) {
 		unsigned long long start, end;
 		start = RDTSC_START();
 		int num_threads = 1;
+
+#if defined(BCACHE_FLUSHER)
+		thread flusher(bcache_flusher_fn, eid, db_id);
+#endif
 		
 		//ecall_column_sort_table_dbg(eid, &ret, db_id, rankings_table_id, column);
 		column_sort_table_parallel(eid, db_id, rankings_table_id, column, num_threads);
@@ -361,6 +478,10 @@ int test_rankings(sgx_enclave_id_t eid) {
 		ecall_flush_table(eid, &ret, db_id, rankings_table_id);
 		end = RDTSCP();
 
+#if defined(BCACHE_FLUSHER)
+		bcache_flusher_stop(eid, db_id, &flusher);
+#endif
+
 		printf("Sorting + flushing %d rows took %llu cycles (%f sec, %f rows/sec)\n", RANKINGS_TABLE_SIZE, end - start, (end - start) / cycles_per_sec, RANKINGS_TABLE_SIZE / ((end - start) / cycles_per_sec));
 		ecall_print_table_dbg(eid, &ret, db_id, rankings_table_id, 0, 23);
 
@@ -468,7 +589,7 @@ int test_bitonic_sort(sgx_enclave_id_t eid)
 
 	sc = derive_schema(rand_int_type_arr, NUM_ELEMENTS(rand_int_type_arr));
 
-	sgx_ret = ecall_create_db(eid, &ret, db_name.c_str(), db_name.length(), &db_id);
+	sgx_ret = ecall_create_db(eid, &ret, db_name.c_str(), db_name.length(), 0, 0, &db_id);
 	if (sgx_ret || ret) {
 		ERR("create db error:%d (sgx ret:%d)\n", ret, sgx_ret);
 		return ret;
@@ -558,7 +679,7 @@ int test_column_sort(sgx_enclave_id_t eid)
 
 	sc = derive_schema(rand_int_type_arr, NUM_ELEMENTS(rand_int_type_arr));
 
-	sgx_ret = ecall_create_db(eid, &ret, db_name.c_str(), db_name.length(), &db_id);
+	sgx_ret = ecall_create_db(eid, &ret, db_name.c_str(), db_name.length(), 0, 0, &db_id);
 	if (sgx_ret || ret) {
 		ERR("create db error:%d (sgx ret:%d)\n", ret, sgx_ret);
 		return ret;
@@ -635,7 +756,7 @@ int test_quick_sort(sgx_enclave_id_t eid)
 
 	sc = derive_schema(rankings_type_arr, NUM_ELEMENTS(rankings_type_arr));
 
-	sgx_ret = ecall_create_db(eid, &ret, db_name.c_str(), db_name.length(), &db_id);
+	sgx_ret = ecall_create_db(eid, &ret, db_name.c_str(), db_name.length(), 0, 0, &db_id);
 	if (sgx_ret || ret) {
 		ERR("create db error:%d (sgx ret:%d)\n", ret, sgx_ret);
 		return ret;
@@ -662,11 +783,10 @@ int test_quick_sort(sgx_enclave_id_t eid)
 	{
 		int sorted_id;
 		unsigned long long start, end;
+		auto num_threads = 4u;
 		start = RDTSC_START();
-		//auto num_threads = 2u;
 		ecall_quicksort_table(eid, &ret, db_id, table_id, 1, &sorted_id);
 
-		//quick_sort_parallel(eid, db_id, table_id, 0, num_threads);
 #ifdef CREATE_SORTED_TABLE
 		ecall_flush_table(eid, &ret, db_id, sorted_id);
 #endif
@@ -676,6 +796,17 @@ int test_quick_sort(sgx_enclave_id_t eid)
 #ifdef PRINT_SORTED_TABLE
 		ecall_print_table_dbg(eid, &ret, db_id, table_id, 0, 16);
 #endif
+
+		/* Same again on the other column with all threads sorting */
+		start = RDTSC_START();
+		quick_sort_parallel(eid, db_id, table_id, 2, num_threads);
+		ecall_flush_table(eid, &ret, db_id, table_id);
+		end = RDTSCP();
+		printf("Quick Sorting table (in-place, %u threads) + flushing took %llu cycles\n", 
+			num_threads, end - start);
+#ifdef PRINT_SORTED_TABLE
+		ecall_print_table_dbg(eid, &ret, db_id, table_id, 0, 16);
+#endif
 	}
 
 	ret = 0;
@@ -698,7 +829,7 @@ int test_merge_sort_write(sgx_enclave_id_t eid)
 
 	sc = derive_schema(rankings_type_arr, NUM_ELEMENTS(rankings_type_arr));
 
-	sgx_ret = ecall_create_db(eid, &ret, db_name.c_str(), db_name.length(), &db_id);
+	sgx_ret = ecall_create_db(eid, &ret, db_name.c_str(), db_name.length(), 0, 0, &db_id);
 	if (sgx_ret || ret) {
 		ERR("create db error:%d (sgx ret:%d)\n", ret, sgx_ret);
 		return ret; 
@@ -20,6 +20,11 @@ unsigned long long ocall_rdtsc(void) {
 	return RDTSC();
 };
 
+void ocall_usleep(unsigned long usec) {
+	usleep(usec);
+	return;
+};
+
 
 
 void ocall_print_string(const char *str)
@@ -49,6 +54,11 @@ int ocall_open_file(const char *name) {
 	return fd; 
 };
 
+int ocall_truncate_file(int fd) {
+	DBG_ON(IO_VERBOSE, "truncate file fd:%d\n", fd); 
+	return ftruncate(fd, 0);
+};
+
 int ocall_write_file(int fd, void* buf, unsigned long size) {
 	DBG_ON(IO_VERBOSE, "write file fd:%d, buf:%p, size:%lu\n", fd, buf, size);
 	return write(fd, buf, size);
@@ -63,6 +73,36 @@ int ocall_seek(int fd, unsigned long offset) {
 	return lseek(fd, offset, SEEK_SET);
 };
 
+int ocall_pread_block(int fd, void* buf, unsigned long size, unsigned long offset) {
+	unsigned long total = 0;
+	ssize_t ret;
+
+	DBG_ON(IO_VERBOSE, "pread fd:%d, buf:%p, size:%lu, offset:%lu\n", fd, buf, size, offset);
+	while (total < size) {
+		ret = pread(fd, (char *)buf + total, size - total, offset + total);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			break;
+		total += ret;
+	}
+	return total;
+};
+
+int ocall_pwrite_block(int fd, void* buf, unsigned long size, unsigned long offset) {
+	unsigned long total = 0;
+	ssize_t ret;
+
+	DBG_ON(IO_VERBOSE, "pwrite fd:%d, buf:%p, size:%lu, offset:%lu\n", fd, buf, size, offset);
+	while (total < size) {
+		ret = pwrite(fd, (char *)buf + total, size - total, offset + total);
+		if (ret < 0)
+			return ret;
+		total += ret;
+	}
+	return total;
+};
+
 int ocall_close_file(int fd) {
 	DBG_ON(IO_VERBOSE, "close file fd:%d\n", fd);
 	return close(fd);
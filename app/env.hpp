@@ -9,6 +9,7 @@ extern "C" {
 
 /* File operations to read/write tables from disk */
 int ocall_open_file(const char *name); 
+int ocall_truncate_file(int fd); 
 
 void *ocall_alloc_io_buf(unsigned long size); 
 void ocall_free_io_buf(void *buf); 
@@ -16,5 +17,7 @@ void ocall_free_io_buf(void *buf);
 int ocall_write_file(int fd, void* buf, unsigned long size); 
 int ocall_read_file(int fd, void* buf, unsigned long size);
 int ocall_seek(int fd, unsigned long offset);
+int ocall_pread_block(int fd, void* buf, unsigned long size, unsigned long offset);
+int ocall_pwrite_block(int fd, void* buf, unsigned long size, unsigned long offset);
 
 #endif
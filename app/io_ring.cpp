@@ -0,0 +1,78 @@
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "io_ring.hpp"
+#include "dbg.hpp"
+#include "enclave_u.h"
+
+/* Worker threads of the running ring */
+static std::vector<std::thread*> io_workers;
+
+/* Service requests posted by the enclave until the ring is stopped */
+static void io_ring_worker(io_ring_t *ring)
+{
+	io_slot_t *slot;
+	int idle = 0, found;
+
+	while (!ring->stop) {
+		found = 0;
+
+		for (int i = 0; i < IO_RING_SLOTS; i++) {
+			slot = &ring->slots[i];
+
+			if (slot->state != IO_SLOT_SUBMITTED ||
+				!__sync_bool_compare_and_swap(&slot->state, IO_SLOT_SUBMITTED, IO_SLOT_BUSY))
+				continue;
+
+			if (slot->op == IO_OP_READ)
+				slot->result = ocall_pread_block(slot->fd, slot->buf, slot->size, slot->offset);
+			else
+				slot->result = ocall_pwrite_block(slot->fd, slot->buf, slot->size, slot->offset);
+
+			__sync_synchronize();
+			slot->state = IO_SLOT_DONE;
+			found = 1;
+		}
+
+		if (found) {
+			idle = 0;
+		} else if (++idle > IO_RING_SPIN) {
+			sched_yield();
+			idle = 0;
+		}
+	}
+	return;
+}
+
+io_ring_t *io_ring_start(int num_workers)
+{
+	io_ring_t *ring;
+
+	ring = (io_ring_t *)aligned_alloc(64, sizeof(io_ring_t));
+	if (!ring) {
+		ERR("failed to allocate io ring\n");
+		return NULL;
+	}
+	memset(ring, 0, sizeof(io_ring_t));
+
+	for (int i = 0; i < num_workers; i++)
+		io_workers.push_back(new std::thread(io_ring_worker, ring));
+
+	return ring;
+}
+
+void io_ring_stop(io_ring_t *ring)
+{
+	ring->stop = 1;
+
+	for (auto &t : io_workers) {
+		t->join();
+		delete t;
+	}
+	io_workers.clear();
+	free(ring);
+	return;
+}
@@ -12,6 +12,17 @@
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
 //
+// The cache is split into BCACHE_SHARDS shards, each with its own 
+// lock, LRU list, free list and a hash table on (table, blk_num), 
+// so looking up a block doesn't walk the whole LRU list and threads 
+// working on different blocks rarely share a lock. 
+//
+// Each table puts its blocks in a priority class and may have a quota 
+// (bset_class()). A miss first recycles one of the table's own blocks 
+// if it is over its quota, then takes a victim from the lowest class 
+// that has an unused buffer, so a big query streaming through its 
+// temporary tables doesn't evict the blocks everyone else works on. 
+//
 // The implementation uses two state flags internally:
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
@@ -20,102 +31,430 @@
 #include "bcache.hpp"
 #include "db.hpp"
 #include "util.hpp"
+#include "enclave_t.h"
+#include <cerrno>
+#include <algorithm>
 
 #define VERBOSE_BCACHE 0
 #define BCACHE_STATS_VERBOSE	0
-void binit(bcache_t *bcache)
+// Set up a cache of nblks buffers for blocks of blk_size bytes, 
+// the caller allocates the data of each buffer
+int binit(bcache_t *bcache, unsigned long blk_size, unsigned int nblks)
 {
 	data_block_t *b;
+	bcache_shard_t *sh; 
+	unsigned int nbuckets; 
+
+	bcache->ra_depth = BCACHE_READ_AHEAD; 
+	bcache->flusher = BFLUSHER_OFF; 
+	bcache->blk_size = blk_size; 
+	bcache->nblks = nblks; 
+
+	bcache->data_blks = new data_block_t[nblks](); 
+	if(!bcache->data_blks)
+		return -ENOMEM; 
+
+	for(nbuckets = 1; nbuckets < 2 * nblks / BCACHE_SHARDS; nbuckets <<= 1)
+		; 
+
+	for(int i = 0; i < BCACHE_SHARDS; i++) {
+		sh = &bcache->shards[i]; 
+
+		sh->nblks = nblks / BCACHE_SHARDS; 
+		sh->hash_mask = nbuckets - 1; 
+		sh->hash = (data_block_t **)calloc(nbuckets, sizeof(data_block_t *)); 
+		if(!sh->hash) {
+			bfree(bcache); 
+			return -ENOMEM; 
+		}
+
+		initlock(&sh->lock, std::string("bcache shard"));
 
-	initlock(&bcache->lock, std::string("bcache"));
-	initlock(&bcache->iolock, std::string("bcache io"));
+		// Create linked list of buffers
+		sh->head.prev = &sh->head;
+		sh->head.next = &sh->head;
+		sh->hand = &sh->head; 
+		sh->probation.prev = &sh->probation;
+		sh->probation.next = &sh->probation;
+		sh->nprobation = 0; 
+		sh->free = NULL; 
+		memset(sh->nprio, 0, sizeof(sh->nprio)); 
+		sh->npinned = 0; 
 
-	// Create linked list of buffers
-	bcache->head.prev = &bcache->head;
-	bcache->head.next = &bcache->head;
+		memset(&sh->stats, 0, sizeof(sh->stats)); 
+	}
 
-	for(int i = 0; i < DATA_BLKS_PER_DB; i++) {
+	// Deal buffers out to shards, all of them start on the free list
+	for(unsigned int i = 0; i < nblks; i++) {
 		b = &bcache->data_blks[i];
-		b->next = bcache->head.next;
-		b->prev = &bcache->head;
+		sh = &bcache->shards[i % BCACHE_SHARDS]; 
+
+		b->shard = i % BCACHE_SHARDS; 
+		b->next = sh->head.next;
+		b->prev = &sh->head;
+		b->table = NULL; 
+		b->flags = 0; 
+		b->refcnt = 0; 
+		b->ref = 0; 
+		b->seq = 0; 
+		b->flushing = 0; 
+		b->prio = BPRIO_NORMAL; 
 		initlock(&b->lock, std::string("block"));
-		bcache->head.next->prev = b;
-		bcache->head.next = b;
+		sh->head.next->prev = b;
+		sh->head.next = b;
+
+		b->hnext = sh->free; 
+		sh->free = b; 
 	}
+	return 0; 
+}
 
-	bcache->stats.hits = 0; 
-	bcache->stats.read_misses = 0; 
-	bcache->stats.write_misses = 0; 
-	bcache->stats.write_backs = 0; 
+// Free what binit() allocated
+void bfree(bcache_t *bcache)
+{
+	for(int i = 0; i < BCACHE_SHARDS; i++) {
+		free(bcache->shards[i].hash); 
+		bcache->shards[i].hash = NULL; 
+	}
+
+	delete[] bcache->data_blks; 
+	bcache->data_blks = NULL; 
+	bcache->nblks = 0; 
 }
 
 void bcache_stats_read_and_reset(bcache_t *bcache, bcache_stats_t *stats) {
 
-	stats->hits = bcache->stats.hits; 
-	bcache->stats.hits = 0; 
+	memset(stats, 0, sizeof(*stats)); 
 
-	stats->read_misses = bcache->stats.read_misses; 
-	bcache->stats.read_misses = 0; 
-	
-	stats->write_misses = bcache->stats.write_misses; 
-	bcache->stats.write_misses = 0; 
+	for(int i = 0; i < BCACHE_SHARDS; i++) {
+		bcache_shard_stats_t *s = &bcache->shards[i].stats; 
 
-	stats->write_backs = bcache->stats.write_backs; 
-	bcache->stats.write_backs = 0; 
+		stats->shards[i] = *s; 
+		memset(s, 0, sizeof(*s)); 
+
+		stats->hits += stats->shards[i].hits; 
+		stats->read_misses += stats->shards[i].read_misses; 
+		stats->write_misses += stats->shards[i].write_misses; 
+		stats->write_backs += stats->shards[i].write_backs; 
+		stats->read_aheads += stats->shards[i].read_aheads; 
+		stats->flushes += stats->shards[i].flushes; 
+	}
+	stats->ra_depth = bcache->ra_depth; 
 
 	return; 
 }; 
 
 void bcache_info_printf(struct table *table) {
-	DBG("bcache size:%d, num blocks:%d, rows per block: %d\n",
-		DATA_BLKS_PER_DB*DATA_BLOCK_SIZE, DATA_BLKS_PER_DB, 
-		DATA_BLOCK_SIZE / row_size(table));
+	bcache_t *bcache = &table->db->bcache;
+
+	DBG("bcache size:%lu, num blocks:%u, block size:%lu, shards:%d, policy:%s, rows per block: %lu\n",
+		bcache->nblks * bcache->blk_size, bcache->nblks, bcache->blk_size, BCACHE_SHARDS, 
+		BCACHE_POLICY, table->rows_per_blk);
 	return; 
 };
 
 void bcache_stats_printf(bcache_stats_t *stats) {
-	DBG_ON(BCACHE_STATS_VERBOSE, "hits:%d, read misses:%d, write misses:%d, write backs:%d\n",
-		stats->hits, stats->read_misses, stats->write_misses, stats->write_backs);
+	DBG_ON(BCACHE_STATS_VERBOSE, "hits:%d, read misses:%d, write misses:%d, write backs:%d, "
+		"flushes:%d, read aheads:%d (depth:%d)\n",
+		stats->hits, stats->read_misses, stats->write_misses, stats->write_backs, 
+		stats->flushes, stats->read_aheads, stats->ra_depth);
+
+	for(int i = 0; i < BCACHE_SHARDS; i++) {
+		DBG_ON(BCACHE_STATS_VERBOSE, "shard:%d, lock acquires:%d, contended:%d\n",
+			i, stats->shards[i].acquires, stats->shards[i].contended);
+	}
 	return; 
 };
 
-static inline void bcache_stats_hit(bcache_t *bcache) {
-	__sync_fetch_and_add(&bcache->stats.hits, 1); 
+static inline void bcache_stats_read_miss(bcache_shard_t *sh) {
+	__sync_fetch_and_add(&sh->stats.read_misses, 1); 
 	return; 
 };
 
-static inline void bcache_stats_read_miss(bcache_t *bcache) {
-	__sync_fetch_and_add(&bcache->stats.read_misses, 1); 
+static inline void bcache_stats_write_miss(bcache_shard_t *sh) {
+	__sync_fetch_and_add(&sh->stats.write_misses, 1); 
 	return; 
 };
 
-static inline void bcache_stats_write_miss(bcache_t *bcache) {
-	__sync_fetch_and_add(&bcache->stats.write_misses, 1); 
+// Hash a (table, blk_num) pair. The low bits pick the shard, the 
+// rest pick the bucket inside the shard. Only the table pointer 
+// is used (never dereferenced) so stale blocks of deleted tables 
+// can still be unhashed safely. Both halves are mixed into all 
+// bits: tables allocated at a regular stride must not send the 
+// same block number of each of them to one shard
+static inline unsigned long bhash(struct table *table, unsigned long blk_num) {
+	unsigned long key = ((unsigned long)table >> 4) * 0xFF51AFD7ED558CCDUL + 
+		blk_num * 0x9E3779B97F4A7C15UL;
+	key ^= key >> 33; 
+	key *= 0xC4CEB9FE1A85EC53UL; 
+	return key ^ (key >> 33);
+};
+
+static inline unsigned int bhash_shard(unsigned long h) {
+	return h % BCACHE_SHARDS; 
+};
+
+static inline unsigned int bhash_bucket(bcache_shard_t *sh, unsigned long h) {
+	return (h / BCACHE_SHARDS) & sh->hash_mask; 
+};
+
+// Lock a shard, counting how often we have to wait for it
+static inline void bshard_acquire(bcache_shard_t *sh) {
+	if(!tryacquire(&sh->lock)) {
+		acquire(&sh->lock); 
+		sh->stats.contended++; 
+	}
+	sh->stats.acquires++; 
+};
+
+// Walk all buffers of a shard, the LRU list first then the 
+// probation queue, NULL at the end
+static inline data_block_t *bshard_next(bcache_shard_t *sh, data_block_t *b) {
+	b = b->next; 
+	if(b == &sh->head)
+		b = sh->probation.next; 
+	return b == &sh->probation ? NULL : b; 
+};
+
+// Remove block from its hash chain, caller holds the shard lock
+static void bunhash(bcache_shard_t *sh, data_block_t *b) {
+	data_block_t **p; 
+
+	for(p = &sh->hash[bhash_bucket(sh, bhash(b->table, b->blk_num))]; *p; p = &(*p)->hnext) {
+		if(*p == b) {
+			*p = b->hnext;
+			b->hnext = NULL; 
+			return; 
+		}
+	}
+};
+
+// Account for a buffer taking or dropping a block, caller holds the shard lock
+static inline void bcharge(bcache_shard_t *sh, data_block_t *b) {
+	b->prio = b->table->bprio; 
+	sh->nprio[b->prio]++; 
+	__sync_fetch_and_add(&b->table->bcached, 1);
+};
+
+static inline void buncharge(bcache_shard_t *sh, data_block_t *b) {
+	sh->nprio[b->prio]--; 
+	__sync_fetch_and_sub(&b->table->bcached, 1);
+};
+
+// Replacement policy hooks, all but bpolicy_release() are called 
+// with the shard lock held. 
+//
+// LRU keeps the shard list in recency order, release splices the 
+// buffer to the head and victims are taken from the tail. 
+//
+// CLOCK never touches the list, an access just sets the buffer's 
+// reference bit and the hand sweeps the list clearing bits until 
+// it finds an unused buffer whose bit is already clear. 
+//
+// 2Q is LRU plus a probationary FIFO for blocks loaded with the 
+// BH_SEQ hint. A normal access promotes a block to the LRU list. 
+// Victims come from the FIFO once it holds more than its share 
+// (BCACHE_2Q_PROBATION), so a scan can't flush out the hot blocks. 
+
+// Move buffer to the head of a shard list
+static inline void bpolicy_move(data_block_t *head, data_block_t *b) {
+	b->next->prev = b->prev;
+	b->prev->next = b->next;
+	b->next = head->next;
+	b->prev = head;
+	head->next->prev = b;
+	head->next = b;
+};
+
+// Buffer was just filled with a new block
+static inline void bpolicy_insert(bcache_shard_t *sh, data_block_t *b, int hint) {
+#if defined(BCACHE_CLOCK)
+	b->ref = 1; 
+#elif defined(BCACHE_2Q)
+	if(hint & BH_SEQ) {
+		if(!b->seq)
+			sh->nprobation++; 
+		b->seq = 1; 
+		bpolicy_move(&sh->probation, b); 
+	} else {
+		if(b->seq)
+			sh->nprobation--; 
+		b->seq = 0; 
+		bpolicy_move(&sh->head, b); 
+	}
+#endif
 	return; 
 };
 
-static inline void bcache_stats_write_back(bcache_t *bcache) {
-	__sync_fetch_and_add(&bcache->stats.write_backs, 1); 
+// Buffer was found in the cache
+static inline void bpolicy_access(bcache_shard_t *sh, data_block_t *b, int hint) {
+#if defined(BCACHE_CLOCK)
+	b->ref = 1; 
+#elif defined(BCACHE_2Q)
+	// Referenced outside of a scan, promote it
+	if(b->seq && !(hint & BH_SEQ)) {
+		sh->nprobation--; 
+		b->seq = 0; 
+		bpolicy_move(&sh->head, b); 
+	}
+#endif
+	return; 
+};
+
+// Last reference to the buffer was dropped, called without the shard lock
+static inline void bpolicy_release(bcache_shard_t *sh, data_block_t *b) {
+#if defined(BCACHE_2Q)
+	// The probation queue is FIFO, nothing to do
+	if(b->seq)
+		return; 
+
+	bshard_acquire(sh);
+	if(!b->seq)
+		bpolicy_move(&sh->head, b);
+	release(&sh->lock);
+#elif !defined(BCACHE_CLOCK)
+	bshard_acquire(sh);
+
+	// no one is waiting for it.
+	bpolicy_move(&sh->head, b);
+
+	release(&sh->lock);
+#endif
 	return; 
 };
 
+// Can buffer be recycled: unused, clean if asked for, and holding a 
+// block of owner if set, of class prio otherwise
+static inline int bvictim_ok(data_block_t *b, int clean, struct table *owner, int prio) {
+	if(b->refcnt || (clean && (b->flags & B_DIRTY)))
+		return 0; 
+	return owner ? b->table == owner : b->prio == prio; 
+};
+
+// Pick an unused buffer to recycle among the ones bvictim_ok() 
+// accepts, NULL if there is none. 
+static data_block_t *bpolicy_victim(bcache_shard_t *sh, int clean, struct table *owner, int prio) {
+	data_block_t *b;
+
+#if defined(BCACHE_CLOCK)
+	// Two full turns: the first may only be clearing reference bits
+	for(unsigned int i = 0; i < 2 * sh->nblks; i++) {
+		b = sh->hand->next; 
+		if(b == &sh->head)
+			b = b->next; 
+		sh->hand = b; 
+
+		// Only age the buffers we could take
+		if(!bvictim_ok(b, clean, owner, prio))
+			continue; 
+
+		if(b->ref) {
+			b->ref = 0; 
+			continue; 
+		}
+		return b; 
+	}
+	return NULL; 
+#else
+
+#if defined(BCACHE_2Q)
+	if(sh->nprobation > BCACHE_2Q_PROBATION(sh)) {
+		for(b = sh->probation.prev; b != &sh->probation; b = b->prev){
+			if(bvictim_ok(b, 0, owner, prio))
+				return b;
+		}
+	}
+#endif
+	for(b = sh->head.prev; b != &sh->head; b = b->prev){
+		if(bvictim_ok(b, clean, owner, prio))
+			return b;
+	}
+
+#if defined(BCACHE_2Q)
+	// Everything on the LRU list is in use, take a scanned block anyway
+	for(b = sh->probation.prev; b != &sh->probation; b = b->prev){
+		if(bvictim_ok(b, clean, owner, prio))
+			return b;
+	}
+#endif
+	return NULL; 
+#endif
+};
+
+// While the flusher runs prefer clean victims so the miss doesn't 
+// pay for a write-back
+static inline data_block_t *bvictim(bcache_shard_t *sh, int flusher, struct table *owner, int prio) {
+	data_block_t *b = NULL; 
+
+	if(flusher == BFLUSHER_RUNNING)
+		b = bpolicy_victim(sh, 1, owner, prio); 
+	if(!b)
+		b = bpolicy_victim(sh, 0, owner, prio); 
+	return b; 
+};
+
+// Walk the buffers of a shard in roughly the order the policy would 
+// recycle them, start with NULL. Caller holds the shard lock and 
+// bounds the walk (with CLOCK it goes around forever). 
+static data_block_t *bpolicy_cold_next(bcache_shard_t *sh, data_block_t *b) {
+#if defined(BCACHE_CLOCK)
+	b = b ? b->next : sh->hand->next; 
+	if(b == &sh->head)
+		b = b->next; 
+	return b; 
+#else
+
+#if defined(BCACHE_2Q)
+	b = b ? b->prev : sh->probation.prev; 
+	if(b == &sh->probation)
+		b = sh->head.prev; 
+#else
+	b = b ? b->prev : sh->head.prev; 
+#endif
+	return b == &sh->head ? NULL : b; 
+#endif
+};
+
+static int bwrite_back(data_block_t **blks, void **bufs, io_run_t *runs, int n);
 
 // Look through buffer cache for a block with a specific number
 // If not found, allocate a buffer
 // If successfully found a buffer or managed to get a new one 
 // return a locked buffer, if not return NULL
-data_block_t *bget(struct table *table, unsigned int blk_num)
+data_block_t *bget(struct table *table, unsigned int blk_num, int hint)
 {
 	data_block_t *b;
-	int ret; 
+	unsigned long h; 
+	io_run_t run; 
+	void *buf; 
+	int ret, waited = 0; 
 
 	bcache_t *bcache = &table->db->bcache;
 
-	acquire(&bcache->lock);
+	h = bhash(table, blk_num); 
+	bcache_shard_t *sh = &bcache->shards[bhash_shard(h)];
+
+again:
+	bshard_acquire(sh);
+
+	// Don't let pins take the buffers everyone else needs
+	if(hint & BH_PIN) {
+		if(sh->npinned >= sh->nblks - BCACHE_PIN_RESERVE(sh)) {
+			release(&sh->lock);
+			return NULL; 
+		}
+		sh->npinned++; 
+	}
 
 	// Is the block already cached?
-	for(b = bcache->head.next; b != &bcache->head; b = b->next){
+	for(b = sh->hash[bhash_bucket(sh, h)]; b; b = b->hnext){
 		if(b->table == table && b->blk_num == blk_num){
+			// Already cached, nothing to read ahead
+			if(hint & BH_RA) {
+				release(&sh->lock);
+				return NULL; 
+			}
+
 			//unsigned long refcnt = b->refcnt;
 			// Atomic increment, relies on GCC builtins
 			__sync_fetch_and_add(&b->refcnt, 1);
@@ -125,121 +464,621 @@ data_block_t *bget(struct table *table, unsigned int blk_num)
 			//WARN_ON(refcnt + 1 != b->refcnt, "error refcnt + 1 (%d) != b->refcnt (%d)\n", 
 			//	refcnt + 1, b->refcnt);
  
-			
-			release(&bcache->lock);
+			sh->stats.hits++; 			
+			bpolicy_access(sh, b, hint); 
+			release(&sh->lock);
 			acquire(&b->lock);
-			//release(&bcache->lock);
+			//release(&sh->lock);
 
 			DBG_ON(VERBOSE_BCACHE, "blk:%p (flags:%x), num:%d, b->table:%s for table:%s\n", 
 				b, b->flags, blk_num, b->table->name.c_str(), table->name.c_str());
 			
-			bcache_stats_hit(bcache); 
 			return b;
 		}
 	}
 
-	// Not cached; recycle an unused buffer.
-	for(b = bcache->head.prev; b != &bcache->head; b = b->prev){
-		if(b->refcnt == 0) {
-			if(b->flags & B_DIRTY) {
-				DBG_ON(VERBOSE_BCACHE, "write back dirty block: %p (data:%p), num:%lu, table:%s\n", 
-					b, b->data, b->blk_num, b->table->name.c_str()); 
-				ret = write_data_block(b->table, b->blk_num, b->data);
-				if (ret) {
-					ERR("writing dirty block:%lu for table %s\n", 
-						b->blk_num, b->table->name.c_str());
-					
- 					release(&bcache->lock);
-					//acquire(&b->lock);
-					return NULL;
-				}
-				bcache_stats_write_back(bcache);
+	// Not cached; take a free buffer if there is one
+	if(sh->free) {
+		b = sh->free; 
+		sh->free = b->hnext; 
+		goto found; 
+	}
+
+	// Otherwise recycle an unused buffer: one of the table's own 
+	// if it is over its quota, else one from the lowest class
+	b = NULL; 
+	if(table->bquota && table->bcached >= table->bquota)
+		b = bvictim(sh, bcache->flusher, table, 0); 
+	for(int prio = BPRIO_LOW; !b && prio < BPRIO_CLASSES; prio++) {
+		if(sh->nprio[prio])
+			b = bvictim(sh, bcache->flusher, NULL, prio); 
+	}
+	if(b) {
+		if(b->flags & B_DIRTY) {
+			// Read-ahead isn't worth a write-back
+			if(hint & BH_RA) {
+				release(&sh->lock);
+				return NULL; 
 			}
 
-			DBG_ON(VERBOSE_BCACHE, "re-using blk:%p (flags:%x), num:%d, b->table:%s for table:%s\n", 
-				b, b->flags, blk_num, b->table ? b->table->name.c_str() : "NULL", table->name.c_str()); 
+			// Only dirty buffers are left. A running flusher is 
+			// about to clean some, back off and let it
+			if(bcache->flusher == BFLUSHER_RUNNING && waited < BCACHE_FLUSHER_WAIT) {
+				if(hint & BH_PIN)
+					sh->npinned--; 
+				release(&sh->lock);
+				for(int i = 0; i < 64 << waited; i++)
+					_mm_pause(); 
+				waited++; 
+				goto again; 
+			}
 
-			b->table = table;
-			b->blk_num = blk_num;
-			b->flags = 0;
-			//ERR_ON(b->refcnt != 0, "ref counter (%d) != 0 blk:%p (flags:%x), num:%d, b->table:%s for table:%s\n", 
-			//	b->refcnt, b, b->flags, blk_num, b->table ? b->table->name.c_str() : "NULL", table->name.c_str()); 
+			// No flusher, or it fell behind: write the victim back 
+			// ourselves rather than fail the miss. Do it without the 
+			// shard lock, like the flusher does, then look for the 
+			// block again: someone may have loaded it meanwhile
+			__sync_fetch_and_add(&b->refcnt, 1);
+			b->flushing = 1; 
+			if(hint & BH_PIN)
+				sh->npinned--; 
+			release(&sh->lock);
 
+			DBG_ON(VERBOSE_BCACHE, "write back dirty block: %p (data:%p), num:%lu, table:%s\n", 
+				b, b->data, b->blk_num, b->table->name.c_str()); 
+			ret = bwrite_back(&b, &buf, &run, 1); 
+			if (ret < 0) {
+				ERR("writing dirty block:%lu for table %s\n", 
+					b->blk_num, b->table->name.c_str());
+				return NULL;
+			}
+			__sync_fetch_and_add(&sh->stats.write_backs, 1); 
+			goto again; 
+		}
 
+		DBG_ON(VERBOSE_BCACHE, "re-using blk:%p (flags:%x), num:%d, b->table:%s for table:%s\n", 
+			b, b->flags, blk_num, b->table ? b->table->name.c_str() : "NULL", table->name.c_str()); 
 
-			b->refcnt = 1;
-			release(&bcache->lock);
-			acquire(&b->lock);
-			//release(&bcache->lock);
+		bunhash(sh, b); 
+		buncharge(sh, b); 
+		goto found; 
+	}
+	if(hint & (BH_RA | BH_PIN)) {
+		if(hint & BH_PIN)
+			sh->npinned--; 
+		release(&sh->lock);
+		return NULL; 
+	}
 
-			return b;
+	ERR("panic: no buffers in shard %lu\n", sh - bcache->shards);
+
+	/* print buffer cache shard */
+	for(b = bshard_next(sh, &sh->head); b; b = bshard_next(sh, b)){
+		ERR("table: %s, blk:%d, refcnt:%d, flags:%x\n", 
+			b->table ? b->table->name.c_str() : "NULL", b->blk_num, b->refcnt, b->flags);
+	}
+
+	release(&sh->lock);
+	return NULL;
+
+found:
+	b->table = table;
+	b->blk_num = blk_num;
+	b->flags = 0;
+	bcharge(sh, b); 
+
+	b->hnext = sh->hash[bhash_bucket(sh, h)];
+	sh->hash[bhash_bucket(sh, h)] = b;
+	//ERR_ON(b->refcnt != 0, "ref counter (%d) != 0 blk:%p (flags:%x), num:%d, b->table:%s for table:%s\n", 
+	//	b->refcnt, b, b->flags, blk_num, b->table ? b->table->name.c_str() : "NULL", table->name.c_str()); 
+
+	b->refcnt = 1;
+	bpolicy_insert(sh, b, hint); 
+	release(&sh->lock);
+	acquire(&b->lock);
+	//release(&sh->lock);
+
+	return b;
+}
+
+static bool bblk_less(const data_block_t *a, const data_block_t *b) {
+	if(a->table != b->table)
+		return a->table < b->table; 
+	return a->blk_num < b->blk_num; 
+}
+
+// Sort dirty blocks that the caller pinned (refcnt and flushing set) 
+// by (table, blk_num), clear their dirty bits and describe each run of 
+// consecutive blocks in runs. bufs and runs have room for n entries. 
+// Returns the number of runs
+static int bwrite_prepare(data_block_t **blks, void **bufs, io_run_t *runs, int n)
+{
+	data_block_t *b; 
+	int run, nruns = 0; 
+
+	std::sort(blks, blks + n, bblk_less); 
+
+	for(int i = 0; i < n; i += run) {
+		for(run = 0; i + run < n; run++) {
+			b = blks[i + run]; 
+			if(run && (b->table != blks[i]->table || b->blk_num != blks[i]->blk_num + run))
+				break; 
+
+			// Clear the dirty bit first, a write that races with 
+			// the write-back marks the block dirty again
+			acquire(&b->lock); 
+			b->flags &= ~B_DIRTY;
+			release(&b->lock); 
+
+			bufs[i + run] = b->data; 
 		}
+
+		DBG_ON(VERBOSE_BCACHE, "write back blocks %lu-%lu, table:%s\n", 
+			blks[i]->blk_num, blks[i]->blk_num + run - 1, blks[i]->table->name.c_str()); 
+
+		runs[nruns].table = blks[i]->table; 
+		runs[nruns].blk_num = blks[i]->blk_num; 
+		runs[nruns].bufs = &bufs[i]; 
+		runs[nruns].nblks = run; 
+		nruns++; 
 	}
-	ERR("panic: no buffers\n");
+	return nruns; 
+}
 
-	/* print buffer cache */
-	for(b = bcache->head.next; b != &bcache->head; b = b->next){
-		ERR("table: %s, blk:%d, refcnt:%d, flags:%x\n", 
-			b->table->name.c_str(), b->blk_num, b->refcnt, b->flags);
+// Unpin blocks whose write-back finished, a failed one is dirty again
+static void bwrite_done(data_block_t **blks, int n, int ret)
+{
+	if (ret) {
+		ERR("writing back %d dirty blocks\n", n); 
+		for(int i = 0; i < n; i++)
+			bwrite(blks[i]); 
+	}
+
+	for(int i = 0; i < n; i++) {
+		blks[i]->flushing = 0; 
+		__sync_fetch_and_sub(&blks[i]->refcnt, 1);
 	}
+}
 
+// Write back dirty blocks that the caller pinned, all runs are handed 
+// to write_data_runs() as one batch. bufs and runs have room for n 
+// entries. Unpins the blocks, returns the number of blocks written 
+// or < 0 if a write failed. 
+static int bwrite_back(data_block_t **blks, void **bufs, io_run_t *runs, int n)
+{
+	int nruns, ret; 
 
-	release(&bcache->lock);
-	return NULL;
+	nruns = bwrite_prepare(blks, bufs, runs, n); 
+	ret = write_data_runs(runs, nruns); 
+	bwrite_done(blks, n, ret); 
+	return ret ? ret : n; 
 }
 
 int bflush(struct table *table)
+{
+	data_block_t *b, **blks;
+	bcache_shard_t *sh; 
+	io_run_t *runs; 
+	void **bufs; 
+	int n = 0, ret; 
+
+	bcache_t *bcache = &table->db->bcache;
+
+	blks = (data_block_t **)malloc(bcache->nblks * sizeof(data_block_t *)); 
+	bufs = (void **)malloc(bcache->nblks * sizeof(void *)); 
+	runs = (io_run_t *)malloc(bcache->nblks * sizeof(io_run_t)); 
+	if(!blks || !bufs || !runs) {
+		free(blks); 
+		free(bufs); 
+		free(runs); 
+		return -ENOMEM; 
+	}
+
+	// Collect and pin the dirty blocks, they are written without 
+	// holding the shard locks
+	for(int i = 0; i < BCACHE_SHARDS; i++) {
+		sh = &bcache->shards[i]; 
+
+again:
+		bshard_acquire(sh);
+
+		// A block the flusher is writing back is already clean, 
+		// but a newer write may follow it. Wait for it so the two 
+		// write-backs can't land out of order
+		for(b = bshard_next(sh, &sh->head); b; b = bshard_next(sh, b)) {
+			if(b->table == table && b->flushing) {
+				release(&sh->lock);
+				while(b->flushing)
+					_mm_pause();
+				goto again; 
+			}
+		}
+
+		for(b = bshard_next(sh, &sh->head); b; b = bshard_next(sh, b)) {
+			if(b->table == table && b->flags & B_DIRTY) {
+				__sync_fetch_and_add(&b->refcnt, 1);
+				b->flushing = 1; 
+				blks[n++] = b; 
+			}
+		}
+
+		release(&sh->lock);
+	}
+
+	ret = bwrite_back(blks, bufs, runs, n); 
+
+	free(blks); 
+	free(bufs); 
+	free(runs); 
+	return ret < 0 ? -1 : 0;
+}
+
+// Drop all cached blocks of a table that is going away (dirty 
+// blocks are not written back), buffers go back to the free list
+void binval(struct table *table)
 {
 	data_block_t *b;
-	int ret; 
+	bcache_shard_t *sh; 
 
 	bcache_t *bcache = &table->db->bcache;
 
-	acquire(&bcache->lock);
+	for(int i = 0; i < BCACHE_SHARDS; i++) {
+		sh = &bcache->shards[i]; 
 
-	// Is the block already cached?
-	for(b = bcache->head.next; b != &bcache->head; b = b->next) {
-		if(b->table == table && b->flags & B_DIRTY) {
-			DBG_ON(VERBOSE_BCACHE, "write back dirty block: %p (data:%p), num:%lu, table:%s\n", 
-					b, b->data, b->blk_num, b->table->name.c_str()); 
-			ret = write_data_block(b->table, b->blk_num, b->data);
-			if (ret) {
-				ERR("writing dirty block:%lu for table %s\n", 
-					b->blk_num, table->name.c_str()); 
+again:
+		bshard_acquire(sh);
+
+		for(b = bshard_next(sh, &sh->head); b; b = bshard_next(sh, b)) {
+			if(b->table != table)
+				continue; 
 
-				release(&bcache->lock);
-				return -1;
+			// It is being written back, wait for it
+			if(b->flushing) {
+				release(&sh->lock);
+				while(b->flushing)
+					_mm_pause();
+				goto again; 
+			}
+
+			if(b->refcnt) {
+				ERR("block:%lu of table %s is still in use (refcnt:%d)\n", 
+					b->blk_num, table->name.c_str(), b->refcnt); 
+				continue; 
+			}
+
+			bunhash(sh, b); 
+			buncharge(sh, b); 
+			b->table = NULL; 
+			b->flags = 0; 
+			b->hnext = sh->free; 
+			sh->free = b; 
+		}
+
+		release(&sh->lock);
+	}
+	return;
+}
+
+// Move a table's cached blocks and the ones it loads from now on to 
+// class prio, and let it keep at most quota blocks cached (0 for no 
+// limit). The quota is soft: a table over it recycles its own unused 
+// blocks first but still gets a buffer when none of them is free
+void bset_class(struct table *table, int prio, unsigned int quota)
+{
+	data_block_t *b;
+	bcache_shard_t *sh; 
+
+	bcache_t *bcache = &table->db->bcache;
+
+	// Misses read these under the shard lock, taken below
+	table->bprio = prio; 
+	table->bquota = quota; 
+
+	for(int i = 0; i < BCACHE_SHARDS; i++) {
+		sh = &bcache->shards[i]; 
+
+		bshard_acquire(sh);
+
+		for(b = bshard_next(sh, &sh->head); b; b = bshard_next(sh, b)) {
+			if(b->table == table && b->prio != prio) {
+				sh->nprio[b->prio]--; 
+				sh->nprio[prio]++; 
+				b->prio = prio; 
+			}
+		}
+
+		release(&sh->lock);
+	}
+	return;
+}
+
+// Pin dirty unused blocks at the cold end of a shard until there 
+// would be BCACHE_CLEAN_LOW clean ones, at most max of them. 
+// Returns how many were pinned into dirty
+static int bflusher_collect(bcache_shard_t *sh, data_block_t **dirty, unsigned int max)
+{
+	data_block_t *b = NULL;
+	unsigned int clean = 0, n = 0; 
+
+	bshard_acquire(sh);
+
+	for(unsigned int i = 0; i < BCACHE_FLUSH_SCAN(sh) && clean + n < BCACHE_CLEAN_LOW(sh) && n < max; i++) {
+		b = bpolicy_cold_next(sh, b); 
+		if(!b)
+			break; 
+
+		if(b->refcnt)
+			continue; 
+
+		if(!(b->flags & B_DIRTY)) {
+			clean++; 
+			continue; 
+		}
+
+		// Pin it so it isn't recycled while we write it
+		__sync_fetch_and_add(&b->refcnt, 1);
+		b->flushing = 1; 
+		dirty[n++] = b; 
+	}
+
+	release(&sh->lock);
+	return n; 
+}
+
+#if defined(ASYNC_IO)
+// A flush set written behind: the flusher collects and seals the next 
+// set while the workers write this one
+typedef struct bflush_set {
+	bcache_shard_t *sh; 
+	data_block_t *blks[IO_BATCH_BLKS]; 
+	void *bufs[IO_BATCH_BLKS]; 
+	io_run_t runs[IO_BATCH_BLKS]; 
+	io_batch_t io; 
+	int n; 
+} bflush_set_t; 
+
+// Wait for a set in flight to be written and unpin its blocks
+static void bflush_set_finish(bflush_set_t *set)
+{
+	int ret; 
+
+	if(!set->n)
+		return; 
+
+	ret = write_batch_wait(&set->io); 
+	bwrite_done(set->blks, set->n, ret); 
+	if(!ret)
+		__sync_fetch_and_add(&set->sh->stats.flushes, set->n); 
+	set->n = 0; 
+}
+
+// Collect and seal a flush set of a shard, then finish the previous 
+// set and submit this one. Only one set is in flight at a time, the 
+// previous one was being written while this one was sealed. Returns 
+// the number of blocks submitted, 0 if there were none or on error
+static int bflusher_shard(bcache_shard_t *sh, bflush_set_t *set, bflush_set_t *prev)
+{
+	int nruns, ret; 
+
+	set->n = bflusher_collect(sh, set->blks, IO_BATCH_BLKS); 
+	if(!set->n)
+		return 0; 
+	set->sh = sh; 
+
+	nruns = bwrite_prepare(set->blks, set->bufs, set->runs, set->n); 
+	ret = write_batch_stage(&set->io, set->runs, nruns); 
+
+	bflush_set_finish(prev); 
+
+	if(!ret)
+		ret = write_batch_submit(&set->io); 
+	if(ret) {
+		bwrite_done(set->blks, set->n, ret); 
+		set->n = 0; 
+		return 0; 
+	}
+	return set->n; 
+}
+
+// Write-back daemon, runs in its own enclave thread until 
+// bflusher_stop() is called 
+int bflusher(bcache_t *bcache)
+{
+	bflush_set_t *sets; 
+	int n, cur = 0; 
+
+	sets = (bflush_set_t *)malloc(2 * sizeof(bflush_set_t)); 
+	if(!sets)
+		return -ENOMEM; 
+	memset(sets, 0, 2 * sizeof(bflush_set_t)); 
+
+	for(int i = 0; i < 2; i++) {
+		n = io_batch_init(&sets[i].io, bcache->blk_size); 
+		if(n)
+			goto out; 
+	}
+
+	if(!__sync_bool_compare_and_swap(&bcache->flusher, BFLUSHER_OFF, BFLUSHER_RUNNING)) {
+		ERR("bcache flusher is already running\n"); 
+		n = -1; 
+		goto out; 
+	}
+
+	while(bcache->flusher == BFLUSHER_RUNNING) {
+		n = 0; 
+		for(int i = 0; i < BCACHE_SHARDS; i++) {
+			if(bflusher_shard(&bcache->shards[i], &sets[cur], &sets[!cur])) {
+				cur = !cur; 
+				n++; 
 			}
-			b->flags &= ~B_DIRTY; 
-			
+		}
+
+		// Nothing to write, don't spin inside the enclave or keep 
+		// blocks pinned while we sleep
+		if(!n) {
+			bflush_set_finish(&sets[!cur]); 
+			ocall_usleep(BCACHE_FLUSHER_IDLE_US); 
 		}
 	}
 
-	release(&bcache->lock);
-	return 0;
+	bflush_set_finish(&sets[!cur]); 
+	bcache->flusher = BFLUSHER_OFF; 
+	n = 0; 
+out: 
+	for(int i = 0; i < 2; i++)
+		io_batch_free(&sets[i].io); 
+	free(sets); 
+	return n; 
+}
+#else
+// Write back dirty unused blocks at the cold end of a shard until 
+// there are BCACHE_CLEAN_LOW clean ones, returns number of blocks 
+// written, 0 if the write failed. 
+// dirty, bufs and runs have room for BCACHE_FLUSH_SCAN entries
+static int bflusher_shard(bcache_shard_t *sh, data_block_t **dirty, void **bufs, io_run_t *runs)
+{
+	int n, ret; 
+
+	n = bflusher_collect(sh, dirty, BCACHE_FLUSH_SCAN(sh)); 
+	if(!n)
+		return 0; 
+
+	// On a failed write report nothing written so the flusher backs 
+	// off instead of retrying the same blocks right away
+	ret = bwrite_back(dirty, bufs, runs, n); 
+	if(ret < 0)
+		return 0; 
+	__sync_fetch_and_add(&sh->stats.flushes, ret); 
+	return ret; 
+}
+
+// Write-back daemon, runs in its own enclave thread until 
+// bflusher_stop() is called 
+int bflusher(bcache_t *bcache)
+{
+	data_block_t **dirty; 
+	io_run_t *runs; 
+	void **bufs; 
+	int n, scan = BCACHE_FLUSH_SCAN(&bcache->shards[0]); 
+
+	dirty = (data_block_t **)malloc(scan * sizeof(data_block_t *)); 
+	bufs = (void **)malloc(scan * sizeof(void *)); 
+	runs = (io_run_t *)malloc(scan * sizeof(io_run_t)); 
+	if(!dirty || !bufs || !runs) {
+		n = -ENOMEM; 
+		goto out; 
+	}
+
+	if(!__sync_bool_compare_and_swap(&bcache->flusher, BFLUSHER_OFF, BFLUSHER_RUNNING)) {
+		ERR("bcache flusher is already running\n"); 
+		n = -1; 
+		goto out; 
+	}
+
+	while(bcache->flusher == BFLUSHER_RUNNING) {
+		n = 0; 
+		for(int i = 0; i < BCACHE_SHARDS; i++)
+			n += bflusher_shard(&bcache->shards[i], dirty, bufs, runs); 
+
+		// Nothing to write, don't spin inside the enclave
+		if(!n)
+			ocall_usleep(BCACHE_FLUSHER_IDLE_US); 
+	}
+
+	bcache->flusher = BFLUSHER_OFF; 
+	n = 0; 
+out: 
+	free(dirty); 
+	free(bufs); 
+	free(runs); 
+	return n; 
+}
+#endif
+
+// Stop the flusher and wait for it to exit, -EAGAIN if it isn't running
+int bflusher_stop(bcache_t *bcache)
+{
+	if(!__sync_bool_compare_and_swap(&bcache->flusher, BFLUSHER_RUNNING, BFLUSHER_STOP))
+		return -EAGAIN; 
+
+	while(bcache->flusher != BFLUSHER_OFF)
+		_mm_pause();
+	return 0; 
 }
+
+// Read a block that missed in the cache. If it continues the table's 
+// sequential read stream, grab buffers for up to ra_depth blocks 
+// after it and read them all in one run. 
+static int bread_miss(table_t *table, data_block_t *b, int hint)
+{
+	data_block_t *ra[BCACHE_READ_AHEAD_MAX + 1];
+	void *bufs[BCACHE_READ_AHEAD_MAX + 1];
+	unsigned long nblks; 
+	unsigned int depth; 
+	int n = 1, ret; 
+
+	bcache_t *bcache = &table->db->bcache;
+
+	ra[0] = b; 
+	bufs[0] = b->data; 
+
+	depth = bcache->ra_depth < BCACHE_READ_AHEAD_MAX ? bcache->ra_depth : BCACHE_READ_AHEAD_MAX; 
+	if(depth && b->blk_num == table->ra_next) {
+		// Don't read past the last row of the table
+		nblks = (table->num_rows + table->rows_per_blk - 1) / table->rows_per_blk; 
+
+		for(; n <= depth && b->blk_num + n < nblks; n++) {
+			ra[n] = bget(table, b->blk_num + n, (hint & ~BH_PIN) | BH_RA); 
+			if(!ra[n])
+				break; 
+			bufs[n] = ra[n]->data; 
+		}
+	}
+	table->ra_next = b->blk_num + n; 
+
+	ret = read_data_blocks(table, b->blk_num, bufs, n);
+	if (ret) {
+		ERR("failed reading data blocks %lu-%lu for table:%s\n", 
+			b->blk_num, b->blk_num + n - 1, table->name.c_str());
+	}
+
+	for(int i = 1; i < n; i++) {
+		if(!ret) {
+			ra[i]->flags |= B_VALID; 
+			__sync_fetch_and_add(&bcache->shards[ra[i]->shard].stats.read_aheads, 1); 
+		}
+		release(&ra[i]->lock); 
+		brelse(ra[i]); 
+	}
+	return ret; 
+}
+
 // Return a buf with the contents of the indicated block.
 // Note the buffer is unlocked so multiple threads can use 
 // it in parallel
-data_block_t* bread(table_t *table, unsigned int blk_num)
+data_block_t* bread(table_t *table, unsigned int blk_num, int hint)
 {
 	data_block_t *b;
 	int ret; 
 
-	b = bget(table, blk_num);
+	b = bget(table, blk_num, hint);
 	if(b == NULL)
 		return NULL; 
 	
 	if((b->flags & B_VALID) == 0) {
-		bcache_stats_read_miss(&table->db->bcache);
+		bcache_stats_read_miss(&table->db->bcache.shards[b->shard]);
 		DBG_ON(VERBOSE_BCACHE, "read block: %p (data:%p), num:%lu, table:%s\n", 
 			b, b->data, b->blk_num, table->name.c_str()); 
 
-		ret = read_data_block(table, blk_num, b->data);
+		ret = bread_miss(table, b, hint);
 		if (ret) {
 			ERR("failed reading data block %d for table:%s\n", 
 				blk_num, table->name.c_str());
 			release(&b->lock);
+			// Drop the reference and pin bget() took
+			if(hint & BH_PIN)
+				bunpin(b); 
+			else
+				brelse(b); 
 			return NULL;
 		}
 		b->flags |= B_VALID; 
@@ -248,6 +1087,21 @@ data_block_t* bread(table_t *table, unsigned int blk_num)
 	return b;
 }
 
+// Return a buf for a block the caller is going to fill from scratch, 
+// it isn't read from disk. Like bread() the buffer comes back unlocked
+data_block_t* bnew(table_t *table, unsigned int blk_num)
+{
+	data_block_t *b;
+
+	b = bget(table, blk_num, BH_NORMAL);
+	if(b == NULL)
+		return NULL; 
+
+	b->flags |= B_VALID; 
+	release(&b->lock);
+	return b;
+}
+
 // Mark block as dirty
 void bwrite(data_block_t *b)
 {
@@ -262,14 +1116,14 @@ void bwrite(data_block_t *b)
 }
 
 // Release a buffer.
-// Move to the head of the MRU list.
+// Let the replacement policy know it's no longer used.
 void brelse(data_block_t *b)
 {
 	int old; 
-	bcache_t *bcache = &b->table->db->bcache;
+	bcache_shard_t *sh = &b->table->db->bcache.shards[b->shard];
 	//releasesleep(&b->lock);
 
-	//acquire(&bcache->lock);
+	//acquire(&sh->lock);
 
 	acquire(&b->lock);
 
@@ -283,23 +1137,22 @@ void brelse(data_block_t *b)
 	//			refcnt - 1, b->refcnt);
  	if (old != 1) {
 		release(&b->lock);
-		//release(&bcache->lock);
+		//release(&sh->lock);
 		return; 
 	}	
 
-	acquire(&bcache->lock);
-
-	// no one is waiting for it.
-	b->next->prev = b->prev;
-	b->prev->next = b->next;
-	b->next = bcache->head.next;
-	b->prev = &bcache->head;
-	bcache->head.next->prev = b;
-	bcache->head.next = b;
+	bpolicy_release(sh, b); 
 
 	//release(&b->lock);
-	release(&bcache->lock);
 	release(&b->lock);
 
 	return;
 }
+
+// Release a buffer that was read with BH_PIN
+void bunpin(data_block_t *b)
+{
+	__sync_fetch_and_sub(&b->table->db->bcache.shards[b->shard].npinned, 1);
+	brelse(b); 
+	return;
+}
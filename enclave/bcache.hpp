@@ -2,16 +2,88 @@
 
 #include "spinlock.hpp"
 
-//#define DATA_BLOCK_SIZE (1 << 12) /* 4 KB */
+/* Block size and number of cached blocks are picked per DB when it is 
+   created (ecall_create_db), these are the defaults and the limits */
 #define DATA_BLOCK_SIZE (1 << 16) /* 64 KB */
-
-//#define DATA_BLOCK_SIZE (1 << 19) /* 512 KB */
-
-//#define DATA_BLOCK_SIZE (1 << 20) /* 1 MB  */
-//#define DATA_BLOCK_SIZE (1*(1 << 20)) /* X MB  */
+#define DATA_BLOCK_SIZE_MIN (1 << 12) /* 4 KB */
+#define DATA_BLOCK_SIZE_MAX (1 << 20) /* 1 MB  */
+
+/* With SEAL_BLOCKS every block ends with its AES-GCM nonce and MAC 
+   (block_seal_t), rows only use the space in front of it */
+#if defined(SEAL_BLOCKS)
+#define BLOCK_SEAL_SIZE 32
+#else
+#define BLOCK_SEAL_SIZE 0
+#endif
+#define BLOCK_DATA_SIZE(blk_size) ((blk_size) - BLOCK_SEAL_SIZE)
 
 #define DATA_BLKS_PER_DB 1024 /* data blocks per DB */
-//#define DATA_BLKS_PER_DB 7 /* data blocks per DB */
+#define DATA_BLKS_MAX (1 << 16)
+
+/* The cache is split into independently locked shards, a block 
+   (table, blk_num) always lives in the shard it hashes to. The 
+   number of cached blocks is rounded down to a multiple of it */
+#define BCACHE_SHARDS 8 
+
+/* Replacement policy: LRU unless BCACHE_CLOCK or BCACHE_2Q is defined */
+#if defined(BCACHE_CLOCK)
+#define BCACHE_POLICY "clock"
+#elif defined(BCACHE_2Q)
+#define BCACHE_POLICY "2q"
+#else
+#define BCACHE_POLICY "lru"
+#endif
+
+/* With 2Q, blocks that are streamed through once are kept in a 
+   probationary FIFO that is allowed to grow to this many buffers 
+   before they are recycled ahead of the LRU blocks */
+#define BCACHE_2Q_PROBATION(sh) ((sh)->nblks / 4)
+
+/* A miss that continues a table's sequential read stream also reads 
+   up to this many of the following blocks in the same I/O run */
+#define BCACHE_READ_AHEAD 8
+#define BCACHE_READ_AHEAD_MAX 32
+
+/* The write-back flusher keeps at least BCACHE_CLEAN_LOW clean unused 
+   buffers among the BCACHE_FLUSH_SCAN coldest ones in each shard, and 
+   sleeps for BCACHE_FLUSHER_IDLE_US when there is nothing to write */
+#define BCACHE_CLEAN_LOW(sh) ((sh)->nblks / 8)
+#define BCACHE_FLUSH_SCAN(sh) ((sh)->nblks / 4)
+#define BCACHE_FLUSHER_IDLE_US 100
+/* A miss that finds only dirty victims backs off this many times, 
+   doubling the wait, for the flusher before writing one back itself */
+#define BCACHE_FLUSHER_WAIT 4
+
+/* Pinning (BH_PIN) leaves this many buffers of each shard to 
+   everything else */
+#define BCACHE_PIN_RESERVE(sh) ((sh)->nblks / 8)
+/* Buffers that may be pinned in the whole cache, shards are the same size */
+#define BCACHE_PINNABLE(bc) (BCACHE_SHARDS * \
+	((bc)->shards[0].nblks - BCACHE_PIN_RESERVE(&(bc)->shards[0])))
+/* Enclave heap the cache takes for buffer headers, data and hash chains */
+#define BCACHE_HEAP_SIZE(bc) ((unsigned long)(bc)->nblks * (sizeof(data_block_t) + (bc)->blk_size) + \
+	BCACHE_SHARDS * ((bc)->shards[0].hash_mask + 1UL) * sizeof(data_block_t *))
+
+#define BFLUSHER_OFF     0
+#define BFLUSHER_RUNNING 1
+#define BFLUSHER_STOP    2
+
+/* Access hints for bget()/bread() */
+#define BH_NORMAL 0
+#define BH_SEQ    1 /* block is read once as part of a scan */
+#define BH_RA     2 /* read-ahead: only get a block that isn't cached 
+                       and a buffer that doesn't need a write-back */
+#define BH_PIN    4 /* held until bunpin(), fails quietly when the 
+                       shard is out of buffers it may pin */
+
+/* Priority classes of a table's cached blocks (bset_class()). A miss 
+   recycles a buffer of the lowest class that has an unused one, so 
+   tables that are streamed through give up their buffers before the 
+   ones being worked on */
+#define BPRIO_LOW     0 /* streamed in or out, not used again soon */
+#define BPRIO_NORMAL  1
+#define BPRIO_PIN     2 /* being worked on, recycled last */
+#define BPRIO_CLASSES 3
 
 
 
@@ -21,9 +93,15 @@ typedef struct data_block {
   unsigned long blk_num;
   volatile unsigned int refcnt;
   struct spinlock lock;
+  unsigned int shard; // shard this buffer belongs to
+  volatile unsigned int ref; // CLOCK reference bit
+  unsigned int seq; // 2Q: on the probation queue
+  volatile int flushing; // pinned for a write-back
+  int prio; // BPRIO_* class of the cached block
 
   struct data_block *prev; // LRU cache list
   struct data_block *next;
+  struct data_block *hnext; // hash chain or free list
 
   void *data;
 } data_block_t;
@@ -31,32 +109,80 @@ typedef struct data_block {
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
 
+typedef struct bcache_shard_stats {
+	unsigned int hits; 
+	unsigned int read_misses; 
+	unsigned int write_misses; 
+	unsigned int write_backs; 
+	unsigned int read_aheads; // blocks read ahead of a sequential stream
+	unsigned int flushes;    // dirty blocks written back by the flusher
+	unsigned int acquires;   // times the shard lock was taken 
+	unsigned int contended;  // times the shard lock was found busy 
+} bcache_shard_stats_t; 
+
 typedef struct bcache_stats {
 	unsigned int hits; 
 	unsigned int read_misses; 
 	unsigned int write_misses; 
 	unsigned int write_backs; 
+	unsigned int read_aheads; 
+	unsigned int flushes; 
+	unsigned int ra_depth; 
+	bcache_shard_stats_t shards[BCACHE_SHARDS]; 
 } bcache_stats_t; 
 
-typedef struct bcache {
+typedef struct bcache_shard {
 	struct spinlock lock;
-	struct spinlock iolock;
 
-	data_block_t data_blks[DATA_BLKS_PER_DB];
+	// Linked list of the shard's buffers, through prev/next.
+  	// With LRU head.next is most recently used, with CLOCK 
+	// the list never changes and hand sweeps around it.
+  	data_block_t head;
+	data_block_t *hand; 
+
+	// 2Q probationary FIFO of scanned buffers, head.next is newest
+	data_block_t probation; 
+	unsigned int nprobation; 
+
+	// Buffers that don't hold any block yet, through hnext
+	data_block_t *free; 
+
+	// Hash chains of cached buffers, through hnext, a power of 
+	// two buckets, twice as many as buffers
+	data_block_t **hash;
+	unsigned int hash_mask; 
+
+	unsigned int nblks; // buffers in this shard
+	unsigned int nprio[BPRIO_CLASSES]; // cached blocks per class
+	volatile unsigned int npinned; // blocks held with BH_PIN
+
+	bcache_shard_stats_t stats; 
+} bcache_shard_t;
+
+typedef struct bcache {
+	data_block_t *data_blks;
+	unsigned int nblks; 
+	unsigned long blk_size; 
 	int fd; 
-	bcache_stats_t stats; 
+	unsigned int ra_depth; // read-ahead depth, 0 disables it
+	volatile int flusher;  // BFLUSHER_* state of the write-back thread
 
-	// Linked list of all buffers, through prev/next.
-  	// head.next is most recently used.
-  	data_block_t head;
+	bcache_shard_t shards[BCACHE_SHARDS]; 
 } bcache_t;
 
-void binit(bcache_t *bcache);
-data_block_t *bget(struct table *table, unsigned int blk_num);
-data_block_t* bread(struct table *table, unsigned int blk_num);
+int binit(bcache_t *bcache, unsigned long blk_size, unsigned int nblks);
+void bfree(bcache_t *bcache);
+data_block_t *bget(struct table *table, unsigned int blk_num, int hint);
+data_block_t* bread(struct table *table, unsigned int blk_num, int hint);
+data_block_t* bnew(struct table *table, unsigned int blk_num);
 int bflush(struct table *table);
+void binval(struct table *table);
+void bset_class(struct table *table, int prio, unsigned int quota);
+int bflusher(bcache_t *bcache);
+int bflusher_stop(bcache_t *bcache);
 void bwrite(data_block_t *b);
 void brelse(data_block_t *b);
+void bunpin(data_block_t *b);
 void bcache_stats_read_and_reset(bcache_t *bcache, bcache_stats_t *stats);
 void bcache_stats_printf(bcache_stats_t *stats);
 void bcache_info_printf(struct table *table);
@@ -23,48 +23,38 @@ const int DESCENDING = 0;
    then a[i] and a[j] are interchanged.
 **/
 int compare_and_exchange(table_t *tbl, int column, int i, int j, int dir, int tid) {
-	row_t *row_i, *row_j;
-
-	// FIXME: if tables are pinned, this stack allocation is not needed
-#if defined(ALIGNMENT)
-	__attribute__((aligned(ALIGNMENT))) 
-#endif 
-	row_t row_i_stack;
-#if defined(ALIGNMENT)
-	__attribute__((aligned(ALIGNMENT))) 
-#endif	
-	row_t row_j_stack;
-	row_i = &row_i_stack;
-	row_j = &row_j_stack;
-
-	if(tbl->pinned_blocks) {
-		data_block_t *b_i, *b_j; 
-		get_pinned_row(tbl, i, &b_i, &row_i); 
-		get_pinned_row(tbl, j, &b_j, &row_j);
-	} else {
-		read_row(tbl, i, row_i);
-		read_row(tbl, j, row_j);
+	row_handle_t h_i, h_j;
+	int ret;
+
+	// Compare and swap the rows in place in their blocks
+	init_row_handle(&h_i);
+	init_row_handle(&h_j);
+
+	ret = get_row_handle(tbl, i, &h_i);
+	if (ret)
+		return ret;
+
+	ret = get_row_handle(tbl, j, &h_j);
+	if (ret) {
+		put_row_handle(&h_i);
+		return ret;
 	}
 
 #ifdef OBLI_XCHG
-	bool cond = (dir == compare_rows(&tbl->sc, column, row_i, row_j));
-	obli_cswap((u8*) row_i, (u8*) row_j, row_size(tbl), cond);
+	bool cond = (dir == compare_rows(&tbl->sc, column, h_i.row, h_j.row));
+	obli_cswap((u8*) h_i.row, (u8*) h_j.row, row_size(tbl), cond);
 
-	// XXX: Is this required?
-	if (!tbl->pinned_blocks) {
-		write_row_dbg(tbl, row_i, i);
-		write_row_dbg(tbl, row_j, j);
-	}
+	// Both blocks are written back whether or not the rows moved
+	h_i.dirty = 1;
+	h_j.dirty = 1;
 #else
-	if (dir == compare_rows(&tbl->sc, column, row_i, row_j)) {
-		exchange(tbl, i, j, row_i, row_j, tid);
+	if (dir == compare_rows(&tbl->sc, column, h_i.row, h_j.row)) {
+		swap_rows(tbl, &h_i, &h_j);
 	}
 #endif
 
-#ifdef LOCAL_ALLOC
-	free(row_i);
-	free(row_j);
-#endif
+	put_row_handle(&h_i);
+	put_row_handle(&h_j);
 	return 0;
 }
 
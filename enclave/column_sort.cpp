@@ -52,6 +52,11 @@ int column_sort_pick_params_pow2(unsigned long num_records,
 	do {
 		/* Increase r, start over */
 		r = r * 2;
+		if (r * rec_size > sgx_mem_size) {
+			ERR("no r and s fit %lu records of %lu bytes in %lu bytes\n", 
+				num_records, rec_size, sgx_mem_size);
+			return -1; 
+		}
 
 		/* Choose s: if r is a power of two then to be divisible by s, s
 		   has to be a power of two too */
@@ -98,8 +103,6 @@ int column_sort_pick_params_pow2(unsigned long num_records,
 	return 0;
 }
 
-#if 0
-
 /* 
    - num_records -- number of records in the table
    - rec_size -- size of projected record
@@ -109,6 +112,9 @@ int column_sort_pick_params_pow2(unsigned long num_records,
    - r * s >= num_records
    - r % s = 0 -- r is divisible by s
    - r > 2 * (s - 1)^2
+
+   Pick the r and s that pad the table with the fewest fake rows, 
+   r * s - num_records, and of those the smallest r. 
 */
 
 int column_sort_pick_params(unsigned long num_records, 
@@ -118,87 +124,92 @@ int column_sort_pick_params(unsigned long num_records,
 				unsigned long *r_out, 
 				unsigned long *s_out) 
 {
+	unsigned long r, s, min_r; 
+	unsigned long best_r = 0, best_s = 0; 
 
-	bool all_good = false;
-	unsigned long r, s, min_r = 0;
-  
 	DBG_ON(COLUMNSORT_VERBOSE, 
 		"Searching for r and s for num_records=%d, rec_size=%d, bcache_rec_size=%d, sgx_mem_size=%d\n", num_records, rec_size, bcache_rec_size, sgx_mem_size);
 
-	/* Our goal is to minimize r */
-	s = 0; 
-	do {
-		/* Increase s, start over */
-		s ++;
+	/* Past the s whose smallest allowed r doesn't fit in memory no 
+	   larger s fits either */
+	for (s = 1; ; s++) {
+		min_r = 2 * (s - 1) * (s - 1); 
+		if (min_r * rec_size + s * bcache_rec_size > sgx_mem_size)
+			break; 
 
-		//for (r = (num_records / s) + 1; s < r; s ++) {
-		for (i = 1; ; i++ ) {
+		/* Smallest r that holds the table and is a multiple of s */
+		r = (num_records + s - 1) / s; 
+		if (r < min_r)
+			r = min_r; 
+		r = (r + s - 1) / s * s; 
 
-			r = s*i;
+		DBG_ON(COLUMNSORT_VERBOSE_L2, 
+			"trying r=%d and s=%d, %d fake rows\n", r, s, r * s - num_records);
 
- 			DBG_ON(COLUMNSORT_VERBOSE_L2, 
-				"trying r=%d and s=%d\n", r, s);
-			if (s * r < num_records)
-				continue; 
-	
-			//if( r % s != 0) {
-			//	DBG_ON(COLUMNSORT_VERBOSE_L2, 
-			//	"r (%d) is not divisible by s (%d)\n", r, s);
-			//	continue;
-			//}	
+		if (r * rec_size + s * bcache_rec_size > sgx_mem_size)
+			continue; 
 
-			if ( r < 2*(s - 1)*(s - 1)) {
-				DBG_ON(COLUMNSORT_VERBOSE, 
-					"r (%d) is < 2*(s - 1)^2 (%d), where r=%d, s=%d\n", 
-					r, 2*(s - 1)*(s - 1), r, s);  
-				continue; 
-			}
-		
-			if (r * rec_size + s * bcache_rec_size > sgx_mem_size) {
-				DBG_ON(COLUMNSORT_VERBOSE, 
-					"r * rec_size + s * bcache_rec_size < sgx_mem_size, where r=%d, rec_size %d, s=%d, rec_size:%d, bcache_rec_size:%d, sgx_mem_size:%d\n", 
-					r, rec_size, s, rec_size, bcache_rec_size, sgx_mem_size);  
-				continue; 
-			}
-			
+		if (best_s && (r * s > best_r * best_s || 
+				(r * s == best_r * best_s && r >= best_r)))
+			continue; 
 
-			all_good = true;
-			break;  
-		};
+		best_r = r; 
+		best_s = s; 
+	}
 
- 	
-	} while (!all_good); 
+	if (!best_s) {
+		ERR("no r and s fit %lu records of %lu bytes in %lu bytes\n", 
+			num_records, rec_size, sgx_mem_size);
+		return -1; 
+	}
 
 	DBG_ON(COLUMNSORT_VERBOSE, 
-		"r=%d, s=%d\n", r, s); 
-	*r_out = r; 
-	*s_out = s; 
+		"r=%d, s=%d\n", best_r, best_s); 
+	*r_out = best_r; 
+	*s_out = best_s; 
 
 	return 0;
 }
 
-#endif
+/* Enclave heap left to a sort, the HeapMaxSize less the buffer caches 
+   of the open databases, they take nearly all of the rest */
+static unsigned long column_sort_heap_avail(void) {
+	unsigned long used = 0; 
+	data_base_t *db; 
+
+	for (int i = 0; i < MAX_DATABASES; i++) {
+		if ((db = get_db(i)))
+			used += BCACHE_HEAP_SIZE(&db->bcache); 
+	}
+	return used < ENCLAVE_HEAP_MAX ? ENCLAVE_HEAP_MAX - used : 0; 
+}
 
+barrier_t column_barrier = {.count = 0, .global_sense = 0};
+thread_local volatile unsigned int column_lsense = 0;
+
+/* Write the s column tables back into table, each thread copies whole 
+   column tables. Returns when all of table is written */
 int reassemble_column_tables(table_t** s_tables, table_t *table, row_t *row, int s, int r, int tid, int num_threads)
 {
-	unsigned int row_num = 0; 
-	int ret; 
+	unsigned int row_num; 
+	table_cursor_t c; 
+	int ret = 0; 
 	
-	/* In a parallel setup all work is done by tid 0 */
-	if (tid != 0) 
-		return 0; 
-
 	/* Write sorted table back  */
-	for (unsigned int i = 0; i < s; i ++) {
+	for (unsigned int i = tid; i < s; i += num_threads) {
 
-		for (unsigned int j = 0; j < r; j ++) {
+		row_num = i * r; 
+		cursor_open(&c, s_tables[i], 0, BH_SEQ); 
+		/* Rows past the end of table are the fake ones it was padded with */
+		for (unsigned int j = 0; j < r && row_num < table->num_rows; j ++) {
 
 			/* Read row from s table */
-			ret = read_row(s_tables[i], j, row);
+			ret = cursor_next(&c, row);
 			if(ret) {
 				ERR("failed to read row %d of table %s\n",
 					row_num, s_tables[i]->name.c_str());
-				return -1;
+				ret = -1; 
+				break; 
 			}
 
 			/* Add row to the st table */
@@ -206,12 +217,20 @@ int reassemble_column_tables(table_t** s_tables, table_t *table, row_t *row, int
 			if(ret) {
 				ERR("failed to insert row %d of sorted table %s\n",
 					row_num, table->name.c_str());
-				return -2;
+				ret = -2; 
+				break; 
 			}
 			row_num ++;
 		}
+		cursor_close(&c); 
+		if (ret)
+			break; 
 	}
-	return 0; 
+
+	/* Everyone waits even after a failure, the others are on their 
+	   way to this barrier */
+	barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
+	return ret; 
 }
 
 int compare_tables(table_t *left_tbl, table_t *right_tbl, int tid, int num_threads) {
@@ -288,9 +307,6 @@ int compare_tables(table_t *left, table_t *right) {
 	return compare_tables(left, right, 0, 1);
 }
 
-barrier_t column_barrier = {.count = 0, .global_sense = 0};
-thread_local volatile unsigned int column_lsense = 0;
-
 
 /* r -- number of rows
    s -- number of columns
@@ -300,16 +316,250 @@ thread_local volatile unsigned int column_lsense = 0;
 table_t **s_tables, **st_tables, *tmp_table;
 unsigned long r, s;
 
+#if defined(COLUMNSORT_PER_COLUMN)
+#if !defined(COLUMNSORT_USE_QUICKSORT)
+#error "COLUMNSORT_PER_COLUMN sorts each column table with quicksort"
+#endif
+volatile unsigned long column_next; /* Next column table to hand out */
+#endif
+
+#if !defined(COLUMNSORT_FUSED)
+/* Sort step, sorts each of the s column tables. Pinned while they are 
+   sorted, the tables are only streamed out after that */
+static int sort_column_tables(table_t **tables, int column, int tid, int num_threads) {
+	int ret = 0;
+
+#if defined(COLUMNSORT_PER_COLUMN)
+	/* Enough tables to go around, threads take whole tables off a 
+	   shared counter and sort them alone, no barriers per table */
+	if (s >= num_threads) {
+		unsigned long i; 
+
+		if (tid == 0)
+			column_next = 0; 
+		barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
+
+		while ((i = __sync_fetch_and_add(&column_next, 1)) < s) {
+			bset_class(tables[i], BPRIO_PIN, 0); 
+#if defined(PIN_TABLE)
+			pin_table(tables[i]); 
+#endif
+			if (quick_sort_table(tables[i]->db, tables[i], column, NULL))
+				ret = -1; 
+#if defined(PIN_TABLE)
+			unpin_table_dirty(tables[i]); 
+#endif
+			bset_class(tables[i], BPRIO_LOW, 0); 
+		}
+
+		barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
+		return ret; 
+	}
+#endif
+
+	/* All threads sort each table together */
+	for (unsigned int i = 0; i < s; i++) {
+		if(tid == 0) {
+			bset_class(tables[i], BPRIO_PIN, 0); 
+#if defined(PIN_TABLE)
+			pin_table(tables[i]); 
+#endif
+		}
+		barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
+
+#if defined(COLUMNSORT_USE_QUICKSORT)
+		ret = quicksort_table_parallel(tables[i], column, tid, num_threads);
+#elif defined(COLUMNSORT_USE_BITONIC)
+		ret = bitonic_sort_table_parallel(tables[i], column, tid, num_threads);
+#endif
+
+		barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
+
+		if (tid == 0) {
+#if defined(PIN_TABLE)
+			unpin_table_dirty(tables[i]); 
+#endif
+			bset_class(tables[i], BPRIO_LOW, 0); 
+		}
+	}
+	return ret; 
+}
+#endif
+
+#if defined(COLUMNSORT_FUSED)
+#if !defined(COLUMNSORT_USE_QUICKSORT)
+#error "COLUMNSORT_FUSED sorts each column table with quicksort"
+#endif
+
+/* Fused steps. A sorted column table moves its rows straight into the 
+   tables of the next step and is dropped from the cache unwritten. The 
+   next step only needs the right rows in each table, not their order, 
+   it sorts them. Only the last step writes rows to exact places, into 
+   the table being sorted, so unshifting and writing back is one pass */
+enum fused_step {
+	FUSED_TRANSPOSE,   /* Steps 1 and 2, s tables into st tables */
+	FUSED_UNTRANSPOSE, /* Steps 3 and 4, st tables into s tables */
+	FUSED_SHIFT,       /* Steps 5 and 6, s tables into st tables */
+	FUSED_UNSHIFT,     /* Steps 7 and 8, st tables into the table */
+	FUSED_STEPS, 
+};
+
+static const char *fused_step_names[FUSED_STEPS] = {
+	"Sorted and transposed column tables", 
+	"Sorted and untransposed column tables", 
+	"Sorted and shifted column tables", 
+	"Sorted, unshifted and wrote back column tables", 
+};
+
+/* Move rows [start, end) of sorted column table i to the next step */
+static int fused_move_rows(table_t *table, table_t **tables, unsigned long i, 
+		unsigned long start, unsigned long end, int step, row_t *row)
+{
+	unsigned long shift = r / 2, unshift = r - r / 2; 
+	unsigned long seq; 
+	table_cursor_t c; 
+	int ret = 0; 
+
+	cursor_open(&c, tables[i], start, BH_SEQ); 
+	for (unsigned long j = start; j < end; j++) {
+
+		ret = cursor_next(&c, row);
+		if(ret) {
+			ERR("failed to read row %lu of table %s\n",
+				j, tables[i]->name.c_str());
+			break; 
+		}
+
+		switch (step) {
+		case FUSED_TRANSPOSE:
+			seq = i * r + j; 
+			ret = insert_row_dbg(st_tables[seq % s], row);
+			break; 
+		case FUSED_UNTRANSPOSE:
+			seq = j * s + i; 
+			ret = insert_row_dbg(s_tables[seq / r], row);
+			break; 
+		case FUSED_SHIFT:
+			seq = i * r + j; 
+			ret = insert_row_dbg(st_tables[((seq + shift) / r) % s], row);
+			break; 
+		case FUSED_UNSHIFT:
+			/* The first column is spliced, like in Step 8 */
+			if (i == 0)
+				seq = j < unshift ? j : (s - 1) * r + j; 
+			else
+				seq = i * r + j - shift; 
+			/* Fake rows padding the table to r * s sort last */
+			if (seq < table->num_rows)
+				ret = write_row_dbg(table, row, seq);
+			break; 
+		}
+
+		if(ret) {
+			ERR("failed to move row %lu of table %s\n",
+				j, tables[i]->name.c_str());
+			break; 
+		}
+	}
+	cursor_close(&c); 
+	return ret; 
+}
+
+/* Drop a column table whose rows moved on, it is refilled later */
+static void fused_drop(table_t *t) {
+#if defined(PIN_TABLE)
+	unpin_table(t); 
+#endif
+	binval(t); 
+	t->num_rows = 0; 
+	bset_class(t, BPRIO_LOW, 0); 
+}
+
+/* Tables filling up in a step stay above the ones waiting to be 
+   sorted. Those are dirty and while the flusher runs misses prefer 
+   clean victims, the tail blocks of the tables filling up just 
+   written back */
+static void fused_set_classes(table_t **tables, int step) {
+	table_t **next = step % 2 ? s_tables : st_tables; 
+
+	for (unsigned int i = 0; i < s; i++) {
+		bset_class(tables[i], BPRIO_LOW, 0); 
+		if (step != FUSED_UNSHIFT)
+			bset_class(next[i], BPRIO_NORMAL, 0); 
+	}
+}
+
+/* Sort each of the s column tables and move it to the next step */
+static int sort_move_column_tables(table_t *table, table_t **tables, int step, 
+		int column, int tid, int num_threads, row_t *row) {
+	int ret = 0;
+
+	if (tid == 0)
+		fused_set_classes(tables, step); 
+
+#if defined(COLUMNSORT_PER_COLUMN)
+	if (s >= num_threads) {
+		unsigned long i; 
+
+		if (tid == 0)
+			column_next = 0; 
+		barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
+
+		while ((i = __sync_fetch_and_add(&column_next, 1)) < s) {
+			bset_class(tables[i], BPRIO_PIN, 0); 
+#if defined(PIN_TABLE)
+			pin_table(tables[i]); 
+#endif
+			if (quick_sort_table(tables[i]->db, tables[i], column, NULL))
+				ret = -1; 
+			if (fused_move_rows(table, tables, i, 0, r, step, row))
+				ret = -1; 
+			fused_drop(tables[i]); 
+		}
+
+		barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
+		return ret; 
+	}
+#endif
+
+	barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
+
+	/* All threads sort each table, then move a share of its rows */
+	for (unsigned int i = 0; i < s; i++) {
+		if(tid == 0) {
+			bset_class(tables[i], BPRIO_PIN, 0); 
+#if defined(PIN_TABLE)
+			pin_table(tables[i]); 
+#endif
+		}
+		barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
+
+		if (quicksort_table_parallel(tables[i], column, tid, num_threads))
+			ret = -1; 
+		if (fused_move_rows(table, tables, i, tid * r / num_threads, 
+				(tid + 1) * r / num_threads, step, row))
+			ret = -1; 
+
+		barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
+
+		if (tid == 0)
+			fused_drop(tables[i]); 
+	}
+	return ret; 
+}
+#endif
+
 int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int tid, int num_threads) {
 	int ret = 0;
 	std::string tmp_tbl_name;  
 	row_t *row;
+	table_cursor_t cursor; 
+	table_appender_t app; 
 	unsigned long row_num;  
+#if !defined(COLUMNSORT_FUSED)
 	unsigned long shift = 0, unshift = 0;
-
-#if defined(COLUMNSORT_COMPARE_TABLES)
-	table_t *tmp_table; 
 #endif
+	unsigned long mem_size, cache_size; 
 
 #if defined(REPORT_COLUMNSORT_STATS)
 	unsigned long long start, end; 
@@ -329,10 +579,24 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
 #if defined(REPORT_COLUMNSORT_STATS)
 		dbuf = new dbg_buffer(20);
 #endif
-		ret = column_sort_pick_params_pow2(table->num_rows, table->sc.row_data_size, 
-				DATA_BLOCK_SIZE, 
-				(1 << 20) * 80, 
-				&r, &s);
+		/* Each thread sorts a column pinned in the buffer cache, a 
+		   column gets an equal share of the buffers that may be 
+		   pinned with one more share left to the tables its rows 
+		   move into. It also has to fit in the heap */
+		cache_size = (unsigned long)BCACHE_PINNABLE(&db->bcache) * 
+			db->bcache.blk_size / (num_threads + 1); 
+		mem_size = column_sort_heap_avail(); 
+		if (mem_size > cache_size)
+			mem_size = cache_size; 
+
+#if defined(COLUMNSORT_USE_BITONIC)
+		/* Bitonic sort needs r to be a power of two */
+		ret = column_sort_pick_params_pow2(table->num_rows, row_size(table), 
+				table->db->bcache.blk_size, mem_size, &r, &s);
+#else
+		ret = column_sort_pick_params(table->num_rows, row_size(table), 
+				table->db->bcache.blk_size, mem_size, &r, &s);
+#endif
 		if (ret) {
 			ERR("Can't pick r and s for %s\n", table->name.c_str());
 			return -1;  
@@ -349,6 +613,11 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
 			return -1; 
 		}
 
+#if defined(REPORT_COLUMNSORT_STATS)
+		dbuf->insert("Picked r=%lu, s=%lu for %u rows (%lu fake) with %lu bytes of memory\n",
+			r, s, table->num_rows.load(), r * s - table->num_rows, mem_size);
+#endif
+
 		s_tables = (table_t **)malloc(s * sizeof(table_t *)); 
 		if(!s_tables) {
 			ERR("failed to allocate s_tables\n");
@@ -380,6 +649,10 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
 	
 			DBG_ON(COLUMNSORT_VERBOSE_L2, "Created tmp table %s, id:%d\n", 
             			tmp_tbl_name.c_str(), s_tables[i]->id); 
+
+			// Temp tables are filled and drained by streaming, they 
+			// only get priority while being sorted
+			bset_class(s_tables[i], BPRIO_LOW, 0); 
 		}
 
 #if defined(REPORT_COLUMNSORT_STATS)
@@ -407,6 +680,8 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
 
 			DBG_ON(COLUMNSORT_VERBOSE_L2, "Created tmp table %s, id:%d\n", 
             			tmp_tbl_name.c_str(), st_tables[i]->id); 
+
+			bset_class(st_tables[i], BPRIO_LOW, 0); 
 		}
 	
 #if defined(REPORT_COLUMNSORT_STATS)
@@ -419,36 +694,48 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
 
 		start = RDTSC();
 #endif
+	} /* tid == 0 */
 
+	/* s, r and the tables come from tid 0 */
+	barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
 
-	
-		row_num = 0; 
+	/* Rewrite the table as s column tables, each thread takes an 
+	   s table and fills it from its slice of r rows */
+	for (unsigned int i = tid; i < s; i += num_threads) {
 
-		/* Rewrite the table as s column tables  */
-		for (unsigned int i = 0; i < s; i ++) {
+		cursor_open(&cursor, table, i * r, BH_SEQ); 
+		appender_open(&app, s_tables[i]); 
+		for (unsigned int j = 0; j < r; j ++) {
 
-			for (unsigned int j = 0; j < r; j ++) {
+			row_num = i * r + j; 
 
-				// Read old row
-				ret = read_row(table, row_num, row);
-				if(ret) {
-					ERR("failed to read row %d of table %s\n",
-						row_num, table->name.c_str());
-					goto cleanup;
-				}
+			// Read old row
+			ret = cursor_next(&cursor, row);
+			if(ret) {
+				ERR("failed to read row %d of table %s\n",
+					row_num, table->name.c_str());
+				cursor_close(&cursor); 
+				appender_close(&app); 
+				goto cleanup;
+			}
 
-				
-				/* Add row to the s table */
-				ret = insert_row_dbg(s_tables[i], row);
-				if(ret) {
-					ERR("failed to insert row %d of column table %s\n",
-						row_num, s_tables[i]->name.c_str());
-					goto cleanup;
-				}
-				row_num ++;
+			/* Add row to the s table */
+			ret = append_row(&app, row);
+			if(ret) {
+				ERR("failed to insert row %d of column table %s\n",
+					row_num, s_tables[i]->name.c_str());
+				cursor_close(&cursor); 
+				appender_close(&app); 
+				goto cleanup;
 			}
 		}
-	
+		appender_close(&app); 
+		cursor_close(&cursor); 
+	}
+
+	barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
+
+	if (tid == 0) {
 #if defined(REPORT_COLUMNSORT_STATS)
 		end = RDTSC();
 		cycles = end - start;
@@ -483,37 +770,44 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
 	}
 	barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
 
+#if defined(COLUMNSORT_FUSED)
+	for (int step = FUSED_TRANSPOSE; step < FUSED_STEPS; step++) {
 #if defined(REPORT_COLUMNSORT_STATS)
-	start = RDTSC(); 
-#endif
-
-	/* All threads sort table in parallel */
-	for (unsigned int i = 0; i < s; i++) {
-#if defined(PIN_TABLE)
-		if(tid == 0) {
-			pin_table(s_tables[i]); 
-		}
+		start = RDTSC(); 
 #endif
-		barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
+		// Even steps start from the s tables, odd ones from st tables
+		ret = sort_move_column_tables(table, step % 2 ? st_tables : s_tables, 
+				step, column, tid, num_threads, row);
 
-#if defined(COLUMNSORT_USE_QUICKSORT)
-		// TODO: use parallel quicksort
 		if (tid == 0) {
-			quick_sort_table(db, s_tables[i], column, NULL);
-		}	
-#elif defined(COLUMNSORT_USE_BITONIC)
-		ret = bitonic_sort_table_parallel(s_tables[i], column, tid, num_threads);
-#endif
+#if defined(REPORT_COLUMNSORT_STATS)
+			end = RDTSC();
+			cycles = end - start;
+			secs = (cycles / cycles_per_sec);
 
-		barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
+			dbuf->insert("Step %d-%d: %s in %llu cycles (%f sec)\n",
+				2 * step + 1, 2 * step + 2, fused_step_names[step], 
+				cycles, secs);
 
-		if (tid == 0) {
-#if defined(PIN_TABLE)
-			unpin_table_dirty(s_tables[i]); 
+			bcache_stats_read_and_reset(&db->bcache, &bstats);
+			bcache_stats_printf(&bstats); 
 #endif
+			DBG_ON(COLUMNSORT_VERBOSE, "Step %d-%d: %s\n", 
+				2 * step + 1, 2 * step + 2, fused_step_names[step]);
 		}
 	}
 
+#if defined(COLUMNSORT_DBG)
+	if (tid == 0)
+		print_table_dbg(table, 0, table->num_rows);
+#endif
+#else
+#if defined(REPORT_COLUMNSORT_STATS)
+	start = RDTSC(); 
+#endif
+
+	ret = sort_column_tables(s_tables, column, tid, num_threads);
+
 	if(tid == 0) {
 #if defined(REPORT_COLUMNSORT_STATS)
 		end = RDTSC();
@@ -549,14 +843,16 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
 	/* Transpose s column tables into s transposed tables  */
 	for (unsigned int i = 0 + tid; i < s; i += num_threads) {
 
+		cursor_open(&cursor, s_tables[i], 0, BH_SEQ); 
 		for (unsigned int j = 0; j < r; j ++) {
 			unsigned long seq; 
 
 			// Read old row
-			ret = read_row(s_tables[i], j, row);
+			ret = cursor_next(&cursor, row);
 			if(ret) {
 				ERR("failed to read row %d of table %s\n",
 					j, s_tables[i]->name.c_str());
+				cursor_close(&cursor); 
 				goto cleanup;
 			}
 
@@ -580,6 +876,7 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
 			if(ret) {
 				ERR("failed to insert row %d of transposed column table %s\n",
 					j, st_tables[j % s]->name.c_str());
+				cursor_close(&cursor); 
 				goto cleanup;
 			}
 
@@ -588,10 +885,12 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
 			if(ret) {
 				ERR("failed to insert row %d of transposed column table %s\n",
 					j, st_tables[j % s]->name.c_str());
+				cursor_close(&cursor); 
 				goto cleanup;
 			}
 #endif
 		}
+		cursor_close(&cursor); 
 	}
 
 	barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
@@ -622,41 +921,15 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
 	start = RDTSC(); 
 #endif
 
-	for (unsigned int i = 0; i < s; i++) {
-		//bitonic_sort_table(db, st_tables[i], column, &tmp_table);
-#if defined(PIN_TABLE)
-		if(tid == 0) {
-			pin_table(st_tables[i]); 
-		}
-#endif
-
-		barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
-
-		if (tid == 0) {
-			// Clean s tables so we can do insert_row again
-			for (unsigned int i = 0; i < s; i++) {
-				s_tables[i]->num_rows = 0; 
-			}
- 
-		}
-#if defined(COLUMNSORT_USE_QUICKSORT)
-        // TODO: use parallel quicksort
-        if (tid == 0) {
-            quick_sort_table(db, st_tables[i], column, NULL);
-        }
-#elif defined(COLUMNSORT_USE_BITONIC)
-		ret = bitonic_sort_table_parallel(st_tables[i], column, tid, num_threads);
-#endif
-
-		barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
-
-		if (tid == 0) {
-#if defined(PIN_TABLE)
-			unpin_table_dirty(st_tables[i]);
-#endif
+	if (tid == 0) {
+		// Clean s tables so we can do insert_row again
+		for (unsigned int i = 0; i < s; i++) {
+			s_tables[i]->num_rows = 0; 
 		}
 	}
 
+	ret = sort_column_tables(st_tables, column, tid, num_threads);
+
 	if (tid == 0) {
 
 #if defined(REPORT_COLUMNSORT_STATS)
@@ -691,7 +964,7 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
 			unsigned long seq; 
 
 			/* Read row from st table */
-			ret = read_row(st_tables[j], i, row);
+			ret = read_row_seq(st_tables[j], i, row);
 			if(ret) {
 				ERR("failed to read row %d of table %s\n",
 					i, st_tables[j]->name.c_str());
@@ -747,29 +1020,7 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
 	start = RDTSC(); 
 #endif
 
-	for (unsigned int i = 0; i < s; i++) {
-	//	bitonic_sort_table(db, s_tables[i], column, &tmp_table);
-#if defined(PIN_TABLE)
-		if(tid == 0) {
-			pin_table(s_tables[i]); 
-		}
-#endif
-		barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
-#if defined(COLUMNSORT_USE_QUICKSORT)
-		// TODO: use parallel quicksort
-		if (tid == 0) {
-			quick_sort_table(db, s_tables[i], column, NULL);
-		}
-#elif defined(COLUMNSORT_USE_BITONIC)
-		ret = bitonic_sort_table_parallel(s_tables[i], column, tid, num_threads);
-#endif
-		barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
-		if (tid == 0) {
-#if defined(PIN_TABLE)
-			unpin_table_dirty(s_tables[i]); 
-#endif
-		}
-	}
+	ret = sort_column_tables(s_tables, column, tid, num_threads);
 #if defined(COLUMNSORT_COMPARE_TABLES)
  	ret = reassemble_column_tables(s_tables, tmp_table, row, s, r, tid, num_threads); 
 	if (ret) 
@@ -781,7 +1032,7 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
  		print_table_dbg(tmp_table, 0, 16);
 	}
 #endif
-	if (tid == 0 && 1) {
+	if (tid == 0) {
 
 #if defined(REPORT_COLUMNSORT_STATS)
 		end = RDTSC();
@@ -805,46 +1056,46 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
 		}
 #endif
 
-		shift = r / 2 ;
-		row_num = 0;  
-
 #if defined(REPORT_COLUMNSORT_STATS)
 		start = RDTSC(); 
 #endif
+	} /* tid == 0 */
 
-		/* Shift s tables into st tables  */
-		for (unsigned int i = 0; i < s; i ++) {
+	shift = r / 2 ;
 
-			for (unsigned int j = 0; j < r; j ++) {
+	/* Shift s tables into st tables, each thread takes an s table */
+	for (unsigned int i = tid; i < s; i += num_threads) {
 
-				/* Read row from s table */
-				ret = read_row(s_tables[i], j, row);
-				if(ret) {
-					ERR("failed to read row %d of table %s\n",
-						row_num, s_tables[i]->name.c_str());
-					goto cleanup;
-				}
+		cursor_open(&cursor, s_tables[i], 0, BH_SEQ); 
+		for (unsigned int j = 0; j < r; j ++) {
 
-				/* Add row to the st table */
-				//DBG_ON(COLUMNSORT_VERBOSE,
-				//	"insert row %d of shifted table (%s) at row %d, row_num:%d, shitf:%d\n", 
-				//	j, st_tables[((row_num + shift) / r) % s]->name.c_str(), 
-				//	(row_num + shift) % r, row_num, shift); 
+			row_num = i * r + j; 
 
+			/* Read row from s table */
+			ret = cursor_next(&cursor, row);
+			if(ret) {
+				ERR("failed to read row %d of table %s\n",
+					row_num, s_tables[i]->name.c_str());
+				cursor_close(&cursor); 
+				goto cleanup;
+			}
 
-				
-				/* Add row to the st table */
-				ret = write_row_dbg(st_tables[((row_num + shift) / r) % s], 
-							row, (row_num + shift) % r);
-				if(ret) {
-					ERR("failed to insert row %d of shifted column table %s\n",
-						row, st_tables[i]->name.c_str());
-					goto cleanup;
-				}
-				row_num ++;
+			/* Add row to the st table */
+			ret = write_row_dbg(st_tables[((row_num + shift) / r) % s], 
+						row, (row_num + shift) % r);
+			if(ret) {
+				ERR("failed to insert row %d of shifted column table %s\n",
+					row_num, st_tables[((row_num + shift) / r) % s]->name.c_str());
+				cursor_close(&cursor); 
+				goto cleanup;
 			}
 		}
+		cursor_close(&cursor); 
+	}
+
+	barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
 
+	if (tid == 0) {
 #if defined(REPORT_COLUMNSORT_STATS)
 		end = RDTSC();
 		cycles = end - start;
@@ -872,34 +1123,9 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
 	start = RDTSC(); 
 #endif
 
-	for (unsigned int i = 0; i < s; i++) {
-		//bitonic_sort_table(db, st_tables[i], column, &tmp_table);
-#if defined(PIN_TABLE)
-		if(tid == 0) {
-			pin_table(st_tables[i]); 
-		}
-#endif
-		barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
+	ret = sort_column_tables(st_tables, column, tid, num_threads);
 
-#if defined(COLUMNSORT_USE_QUICKSORT)
-		// TODO: use parallel quicksort
-		if (tid == 0) {
-			quick_sort_table(db, st_tables[i], column, NULL);
-		}
-#elif defined(COLUMNSORT_USE_BITONIC)
-		ret = bitonic_sort_table_parallel(st_tables[i], column, tid, num_threads);
-#endif		
-		barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
-
-		if (tid == 0) {
-#if defined(PIN_TABLE)
-			unpin_table_dirty(st_tables[i]);
-#endif
-		}
-
-	}
-
-	if (tid == 0 && 1) {
+	if (tid == 0) {
 
 #if defined(REPORT_COLUMNSORT_STATS)
 		end = RDTSC();
@@ -925,105 +1151,63 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
 #if defined(REPORT_COLUMNSORT_STATS)
 		start = RDTSC(); 
 #endif
+	} /* tid == 0 */
 
-		row_num = 0;  
-	
-		/* Unshift st tables into s tables  */
+	/* Unshift st tables into s tables, each thread takes an st table */
+
+	/* In Shantanu's implementation (no +/-infinity) the first column
+	   is special --- it's sorted so instead of shifting we have to 
+	   splice it: first half of the column stays in it's place, the 
+	   second half (the max elements) goes to the end of the last 
+	   column. Row j of st[0] lands in row j either way. The rest 
+	   of the st tables shift back by r/2 rows, st[1] into the end 
+	   of s[0], and so on */
+	unshift = r - r / 2; 
 
-		/* In Shantanu's implementation (no +/-infinity) the first column
-	           is special --- it's sorted so instead of shifting we have to 
-		   splice it: first half of the column stays in it's place, the 
-		   second half (the max elements) goes to the last column */
+	for (unsigned int i = tid; i < s; i += num_threads) {
 
-		unshift = r - r / 2; 
-		/* Read half of the row from the st[0] table and write it into 
-                   s[0] table -- this part doesn't move */	
-		for (unsigned int j = 0; j < unshift; j ++) {
+		cursor_open(&cursor, st_tables[i], 0, BH_SEQ); 
+		for (unsigned int j = 0; j < r; j ++) {
+			table_t *s_table; 
+			unsigned int serial; 
 
 			/* Read row from st table */
-			ret = read_row(st_tables[0], j, row);
+			ret = cursor_next(&cursor, row);
 			if(ret) {
 				ERR("failed to read row %d of table %s\n",
-					row_num, st_tables[0]->name.c_str());
+					j, st_tables[i]->name.c_str());
+				cursor_close(&cursor); 
 				goto cleanup;
 			}
 
-			/* Add row to the s table */
-			ret = write_row_dbg(s_tables[0], row, j);
-			if(ret) {
-				ERR("failed to insert row %d of unshifted column table %s\n",
-					row, s_tables[0]->name.c_str());
-				goto cleanup;
+			if (i == 0) {
+				s_table = j < unshift ? s_tables[0] : s_tables[s - 1]; 
+				serial = j; 
+			} else {
+				serial = (i * r) + j - shift; 
+				s_table = s_tables[serial / r]; 
+				serial %= r; 
 			}
-			row_num ++;
-		}
 
-		/* Read the second half of the st[0] table and write it to the 
-                   very end of s[s-1] table */
-		for (unsigned int j = unshift; j < s; j ++) {
-
-			/* Read row from st table */
-			ret = read_row(st_tables[0], j, row);
-			if(ret) {
-				ERR("failed to read row %d of table %s\n",
-					row_num, st_tables[0]->name.c_str());
-				goto cleanup;
-			}
+			DBG_ON(COLUMNSORT_VERBOSE_L2,
+				"insert row %d of st[%d] into %s, row %d, shitf:%d\n", 
+				j, i, s_table->name.c_str(), serial, shift); 
 
 			/* Add row to the s table */
-			ret = write_row_dbg(s_tables[s - 1], row, j);
+			ret = write_row_dbg(s_table, row, serial);
 			if(ret) {
 				ERR("failed to insert row %d of unshifted column table %s\n",
-					row, s_tables[s - 1]->name.c_str());
+					serial, s_table->name.c_str());
+				cursor_close(&cursor); 
 				goto cleanup;
 			}
-			row_num ++;
 		}
+		cursor_close(&cursor); 
+	}
 
-		/* Now shift the rest of the table 
-		   we start from st[1] table and shift it into the
-		   end of s[0], and so on
-		*/
-
-		for (unsigned int i = 1; i < s; i ++) {
-
-			for (unsigned int j = 0; j < r; j ++) {
-				unsigned int serial; 
-	
-				/* Read row from st table */
-				ret = read_row(st_tables[i], j, row);
-				if(ret) {
-					ERR("failed to read row %d of table %s\n",
-						row_num, st_tables[i]->name.c_str());
-					goto cleanup;
-				}
-
-				/* Add row to the st table */
-				//DBG_ON(COLUMNSORT_VERBOSE_L2,
-				//	"insert row %d of unshifted table (%s) at row %d, row_num:%d, shitf:%d\n", 
-				//	j, s_tables[((row_num + (r * s) - shift) / r) % s]->name.c_str(), 
-				//	(row_num + (r * s) - shift) % r, 
-				//	row_num, shift); 
-	
-				serial = (i * r) + j; 
-				serial -= shift; 
-				
-				DBG_ON(COLUMNSORT_VERBOSE_L2,
-					"insert row %d of st[%d] into s[%d], row %d, shitf:%d\n", 
-					j, i, serial / r, serial % r, shift); 
-
-				/* Add row to the s table */
-				ret = write_row_dbg(s_tables[serial / r], 
-							row, serial % r);
-				if(ret) {
-					ERR("failed to insert row %d of unshifted column table %s\n",
-						row, s_tables[i]->name.c_str());
-					goto cleanup;
-				}
-				row_num ++;
-			}
-		}
+	barrier_wait(&column_barrier, &column_lsense, tid, num_threads);
 
+	if (tid == 0) {
 #if defined(REPORT_COLUMNSORT_STATS)
 		end = RDTSC();
 		cycles = end - start;
@@ -1048,27 +1232,26 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
 #if defined(REPORT_COLUMNSORT_STATS)
 		start = RDTSC(); 
 #endif
+	} /* tid == 0 */
 
 #if defined(COLUMNSORT_COMPARE_TABLES)
-	 	ret = reassemble_column_tables(s_tables, tmp_table, row, s, r, tid, num_threads); 
-		if (ret) 
-			goto cleanup; 
+ 	ret = reassemble_column_tables(s_tables, tmp_table, row, s, r, tid, num_threads); 
+	if (ret) 
+		goto cleanup; 
 
-	 	ret = compare_tables(table, tmp_table, tid, num_threads); 
-		if (ret) {
- 			print_table_dbg(table, 0, 16);
- 			print_table_dbg(tmp_table, 0, 16);
-			goto cleanup; 
-		}
+ 	ret = compare_tables(table, tmp_table, tid, num_threads); 
+	if (ret) {
+		print_table_dbg(table, 0, 16);
+ 		print_table_dbg(tmp_table, 0, 16);
+		goto cleanup; 
+	}
 #endif
 
+ 	ret = reassemble_column_tables(s_tables, table, row, s, r, tid, num_threads);
+	if (ret) 
+		goto cleanup; 
 
-		row_num = 0;  
-
-	 	ret = reassemble_column_tables(s_tables, table, row, s, r, tid, num_threads);
-		if (ret) 
-			goto cleanup; 
-
+	if (tid == 0) {
 #if defined(REPORT_COLUMNSORT_STATS)
 		end = RDTSC();
 		cycles = end - start;
@@ -1092,6 +1275,8 @@ int column_sort_table_parallel(data_base_t *db, table_t *table, int column, int
 	} /* tid == 0 */
 
 
+#endif /* COLUMNSORT_FUSED */
+
 	ret = 0;
 cleanup: 
 	if (row) {
@@ -6,9 +6,11 @@
 #include "env.hpp"
 #else
 #include "enclave_t.h"
+#include "sgx_trts.h"
 #endif
 
 #include "bcache.hpp"
+#include "seal.hpp"
 #include "x86.hpp"
 #include "spinlock.hpp"
 
@@ -24,9 +26,11 @@
 #include "column_sort.hpp"
 #include "quick_sort.hpp"
 
-//#define FILE_READ_SIZE (1 << 12)
-
-#define FILE_READ_SIZE DATA_BLOCK_SIZE
+/* Each I/O thread stages blocks in its own slice (io_buf) of one 
+   untrusted arena. A slice holds a whole read-ahead window, so a run 
+   is read with a single ocall and copied into the enclave in one pass */
+#define STAGING_BLKS_PER_THREAD (BCACHE_READ_AHEAD_MAX + 1)
+#define IO_BUF_SIZE(db) ((unsigned long)STAGING_BLKS_PER_THREAD * (db)->bcache.blk_size)
 
 #define OCALL_VERBOSE 0
 #define JOIN_VERBOSE 0
@@ -96,15 +100,19 @@ std::string get_schema_type(schema_type_t t) {
    from the external storage, e.g., disk or NVM into these data blocks, decrypts 
    data and processes it there. 
 
-   Allocate these data blocks. 
+   Allocate nblks data blocks of blk_size bytes. 
  */
-int alloc_data_blocks(data_base_t *db) {
-	int i; 
-	for (i = 0; i < DATA_BLKS_PER_DB; i++) {
+int alloc_data_blocks(data_base_t *db, unsigned long blk_size, unsigned int nblks) {
+	unsigned int i; 
+
+	if (binit(&db->bcache, blk_size, nblks))
+		return -ENOMEM; 
+
+	for (i = 0; i < nblks; i++) {
 #ifdef ALIGNED_ALLOC
-		db->bcache.data_blks[i].data = aligned_malloc(DATA_BLOCK_SIZE, ALIGNMENT);
+		db->bcache.data_blks[i].data = aligned_malloc(blk_size, ALIGNMENT);
 #else
-		db->bcache.data_blks[i].data = malloc(DATA_BLOCK_SIZE);
+		db->bcache.data_blks[i].data = malloc(blk_size);
 #endif
 		if (!db->bcache.data_blks[i].data) {
 			ERR("alloc failed\n"); 
@@ -112,29 +120,29 @@ int alloc_data_blocks(data_base_t *db) {
 		};
 	};
 
-	binit(&db->bcache);
-
-	for (i = 0; i < THREADS_PER_DB; i++) {
-		ocall_alloc_io_buf(&db->io_buf[i], FILE_READ_SIZE);
-		if (!db->io_buf[i]) {
-			ERR("alloc of io buffer failed\n"); 
-			goto cleanup_io_bufs;
-		};
+	ocall_alloc_io_buf(&db->staging, IO_THREADS_PER_DB * IO_BUF_SIZE(db));
+	if (!db->staging) {
+		ERR("alloc of io staging arena failed\n"); 
+		goto cleanup_staging;
 	};
 
-	return 0; 
+	/* We are going to write into it, make sure it's not our own memory */
+	if (!sgx_is_outside_enclave(db->staging, IO_THREADS_PER_DB * IO_BUF_SIZE(db))) {
+		ERR("io staging arena is inside the enclave\n"); 
+		db->staging = NULL; 
+		goto cleanup_staging;
+	}
 
+	for (i = 0; i < IO_THREADS_PER_DB; i++)
+		db->io_buf[i] = (char *)db->staging + i * IO_BUF_SIZE(db); 
 
-cleanup_io_bufs:
-	for (int j = 0; j < i; j++ ) {
-		ocall_free_io_buf(db->io_buf[j]);
-		db->io_buf[j] = NULL; 
-	};
+	return 0; 
 
-	i = DATA_BLKS_PER_DB; 
+cleanup_staging:
+	i = nblks; 
 cleanup: 
 
-	for (int j = 0; j < i; j++ ) {
+	for (unsigned int j = 0; j < i; j++ ) {
 #ifdef ALIGNED_ALLOC
 		aligned_free(db->bcache.data_blks[j].data);
 #else
@@ -142,12 +150,13 @@ cleanup:
 #endif
 		db->bcache.data_blks[j].data = NULL; 
 	};
+	bfree(&db->bcache); 
 	return -ENOMEM;
 };
 
 /* Free data blocks in enclave's memory */
 void free_data_blocks(data_base_t *db) {
-	for (int i = 0; i < DATA_BLKS_PER_DB; i++ ) {
+	for (unsigned int i = 0; i < db->bcache.nblks; i++ ) {
 		if(db->bcache.data_blks[i].data) {
 #ifdef ALIGNED_ALLOC
 			aligned_free(db->bcache.data_blks[i].data);
@@ -158,138 +167,542 @@ void free_data_blocks(data_base_t *db) {
 		}
 	};
 
-	for (int j = 0; j < THREADS_PER_DB; j++ ) {
-		if (db->io_buf[j]) {
-			ocall_free_io_buf(db->io_buf[j]);
-			db->io_buf[j] = NULL; 
-		}
-	};
+	if (db->staging) {
+		ocall_free_io_buf(db->staging);
+		db->staging = NULL; 
+	}
+
+	for (int j = 0; j < IO_THREADS_PER_DB; j++ )
+		db->io_buf[j] = NULL; 
 
+	bfree(&db->bcache); 
 	return; 
 };
 
 
-/* Read data block from external storage into enclave's memory (the memory 
-   region is passed as the  DataBlock argument), decrypt on the fly */
-int read_data_block(table *table, unsigned long blk_num, void *buf) {
-	unsigned long long total_read = 0; 
-	int read, ret; 
+/* Copy len bytes at offset off of a run of block buffers of bs bytes into buf */
+static void copy_from_blocks(void *buf, void **bufs, unsigned long bs, unsigned long long off, unsigned long long len) {
+	unsigned long long n; 
 
-#if defined(REPORT_IO_STATS)
-	unsigned long long start, end; 
-	start = RDTSC();
+	while (len) {
+		n = bs - off % bs; 
+		n = n < len ? n : len; 
+		memcpy(buf, (char *)bufs[off / bs] + off % bs, n); 
+		buf = (char *)buf + n; 
+		off += n; 
+		len -= n; 
+	}
+}
+
+/* Copy len bytes of buf to offset off of a run of block buffers of bs bytes */
+static void copy_to_blocks(void **bufs, unsigned long bs, unsigned long long off, const void *buf, unsigned long long len) {
+	unsigned long long n; 
+
+	while (len) {
+		n = bs - off % bs; 
+		n = n < len ? n : len; 
+		if (buf) {
+			memcpy((char *)bufs[off / bs] + off % bs, buf, n); 
+			buf = (const char *)buf + n; 
+		} else {
+			memset((char *)bufs[off / bs] + off % bs, 0, n); 
+		}
+		off += n; 
+		len -= n; 
+	}
+}
+
+/* Copy nblks whole blocks into a staging buffer for writing, sealing 
+   them on the way out with SEAL_BLOCKS */
+static int stage_blocks(table *table, unsigned long blk_num, void *dst, void **bufs, int nblks) {
+#if defined(SEAL_BLOCKS)
+	return seal_blocks(table, blk_num, bufs, dst, nblks); 
+#else
+	unsigned long bs = table->db->bcache.blk_size; 
+
+	copy_from_blocks(dst, bufs, bs, 0, (unsigned long long)nblks * bs); 
+	return 0; 
 #endif
-	if(tid() >= THREADS_PER_DB) {
-		ERR("tid():%d >= THREADS_PER_DB (%d)\n", tid(), THREADS_PER_DB); 
-		return -1; 
+}
+
+/* Post a request into our slot of the I/O ring and wait for an untrusted 
+   worker to complete it, the transfer size or error ends up in result. 
+   Returns -1 if no worker picked the request up within IO_RING_WAIT 
+   spins, the request is withdrawn and the caller should use an ocall */
+static int io_ring_submit(io_ring_t *ring, int op, int fd, void *buf, 
+			  unsigned long size, unsigned long offset, int *result) {
+	io_slot_t *slot = &ring->slots[tid()]; 
+
+	slot->op = op; 
+	slot->fd = fd; 
+	slot->buf = buf; 
+	slot->size = size; 
+	slot->offset = offset; 
+	__sync_synchronize();
+	slot->state = IO_SLOT_SUBMITTED; 
+
+	for (int i = 0; slot->state == IO_SLOT_SUBMITTED; i++) {
+		if (i == IO_RING_WAIT && 
+		    __sync_bool_compare_and_swap(&slot->state, IO_SLOT_SUBMITTED, IO_SLOT_FREE)) {
+			ERR("no I/O ring worker, falling back to ocalls\n"); 
+			return -1; 
+		}
+		_mm_pause(); 
 	}
 
-#if defined(IO_LOCK)
-	acquire(&table->db->bcache.iolock); 	
-#endif 
-	ocall_seek(&ret, table->fd[tid()], blk_num*DATA_BLOCK_SIZE); 
+	/* A worker has it, wait for the I/O itself */
+	while (slot->state != IO_SLOT_DONE)
+		_mm_pause(); 
 
-#if defined(REPORT_IO_STATS)	
-	end = RDTSC();
-	DBG_ON(IO_VERBOSE, "ocall_seek: %llu cycles\n", end - start);
+	*result = slot->result; 
+	slot->state = IO_SLOT_FREE; 
+
+	/* Don't trust the worker to stay within the buffer */
+	if (*result > (long)size)
+		*result = -1; 
+	return 0; 
+}
+
+/* Positional block I/O through the I/O ring if one is attached and 
+   answers, otherwise with an ocall */
+static int pread_block(data_base_t *db, int fd, void *buf, unsigned long size, unsigned long offset) {
+	int ret; 
+
+	if (db->io_ring) {
+		if (!io_ring_submit(db->io_ring, IO_OP_READ, fd, buf, size, offset, &ret))
+			return ret; 
+		/* Its workers are gone, stop using the ring */
+		db->io_ring = NULL; 
+	}
+
+	ocall_pread_block(&ret, fd, buf, size, offset);
+	return ret; 
+}
+
+static int pwrite_block(data_base_t *db, int fd, void *buf, unsigned long size, unsigned long offset) {
+	int ret; 
+
+	if (db->io_ring) {
+		if (!io_ring_submit(db->io_ring, IO_OP_WRITE, fd, buf, size, offset, &ret))
+			return ret; 
+		/* Its workers are gone, stop using the ring */
+		db->io_ring = NULL; 
+	}
+
+	ocall_pwrite_block(&ret, fd, buf, size, offset);
+	return ret; 
+}
+
+#if defined(ASYNC_IO)
+static int aio_pread(data_base_t *db, int fd, void *buf, unsigned long size, unsigned long offset); 
 #endif
 
+/* Read a run of consecutive data blocks from external storage into 
+   enclave's memory, bufs[i] receives block blk_num + i, decrypt on 
+   the fly. Positional reads don't share a file offset, so threads 
+   can do I/O on the same table in parallel */
+int read_data_blocks(table *table, unsigned long blk_num, void **bufs, int nblks) {
+	unsigned long bs = table->db->bcache.blk_size; 
+	unsigned long long total_read = 0, read_size; 
+	unsigned long long total = (unsigned long long)nblks * bs; 
+	int read; 
+
 #if defined(REPORT_IO_STATS)
+	unsigned long long start, end; 
 	start = RDTSC();
 #endif
-	while (total_read < DATA_BLOCK_SIZE) { 
-		ocall_read_file(&read, table->fd[tid()], 
+	if(tid() >= IO_THREADS_PER_DB) {
+		ERR("tid():%d >= IO_THREADS_PER_DB (%d)\n", tid(), IO_THREADS_PER_DB); 
+		return -1; 
+	}
+
+	while (total_read < total) { 
+		read_size = (total - total_read) < IO_BUF_SIZE(table->db) ? 
+			(total - total_read) : IO_BUF_SIZE(table->db);  
+
+#if defined(ASYNC_IO)
+		read = aio_pread(table->db, table->fd[tid()], 
 				table->db->io_buf[tid()], 
-				FILE_READ_SIZE);
-		if (read < 0) {
-#if defined(IO_LOCK)
-			release(&table->db->bcache.iolock); 	
+				read_size, blk_num*bs + total_read);
+#else
+		read = pread_block(table->db, table->fd[tid()], 
+				table->db->io_buf[tid()], 
+				read_size, blk_num*bs + total_read);
 #endif
+		if (read < 0) {
 			ERR("read failed\n");
 			return read;
 		}
 
-		if (read == 0) {
+		/* Copy data from the I/O buffer into bcache buffers */
+		copy_to_blocks(bufs, bs, total_read, table->db->io_buf[tid()], read); 
+		total_read += read;  
+
+		if (read < read_size) {
 			/* We've reached the end of file, pad with zeroes */
-			read = DATA_BLOCK_SIZE - total_read; 
-			memset((void *)((char *)buf + total_read), 0, read); 
-#if defined(IO_LOCK)
-			release(&table->db->bcache.iolock); 	
-#endif
-			return 0; 
-		} else {
-			/* Copy data from the I/O buffer into bcache buffer */
-			memcpy((void *)((char *)buf + total_read), table->db->io_buf[tid()], read); 
+			copy_to_blocks(bufs, bs, total_read, NULL, total - total_read); 
+			break; 
 		}
-		total_read += read;  
 	}
-#if defined(IO_LOCK)
-	release(&table->db->bcache.iolock); 	
+
+#if defined(SEAL_BLOCKS)
+	if (unseal_blocks(table, blk_num, bufs, nblks))
+		return -1; 
 #endif
 
 #if defined(REPORT_IO_STATS)
 	end = RDTSC();
 	DBG_ON(IO_VERBOSE, 
-		"ocall_read_file: %llu cycles\n", end - start);
+		"pread_block: %llu cycles\n", end - start);
 #endif
 	return 0; 
 }
 
-/* Write data block from enclave's memory back to disk. 
- * For temporary results, we'll create temporary tables that will 
- * have corresponding encryption keys (huh?)
-*/
-int write_data_block(table *table, unsigned long blk_num, void *buf) {
+/* Read data block from external storage into enclave's memory (the memory 
+   region is passed as the  DataBlock argument), decrypt on the fly */
+int read_data_block(table *table, unsigned long blk_num, void *buf) {
+	return read_data_blocks(table, blk_num, &buf, 1); 
+}
+
+/* Write a run of consecutive data blocks back to disk, bufs[i] holds 
+   block blk_num + i */
+int write_data_blocks(table *table, unsigned long blk_num, void **bufs, int nblks) {
+	unsigned long bs = table->db->bcache.blk_size; 
 	unsigned long long total_written = 0, write_size; 
-	int written, ret; 
+	unsigned long long total = (unsigned long long)nblks * bs; 
+	int written; 
 
-	if(tid() >= THREADS_PER_DB) {
-		ERR("tid():%d >= THREADS_PER_DB (%d)\n", tid(), THREADS_PER_DB); 
+	if(tid() >= IO_THREADS_PER_DB) {
+		ERR("tid():%d >= IO_THREADS_PER_DB (%d)\n", tid(), IO_THREADS_PER_DB); 
 		return -1; 
 	}	
 
-#if defined(IO_LOCK)
-	acquire(&table->db->bcache.iolock); 	
-#endif
-
-	ocall_seek(&ret, table->fd[tid()], blk_num*DATA_BLOCK_SIZE);
- 
-	while (total_written < DATA_BLOCK_SIZE) { 
-		/* make sure we don't write more than DATA_BLOCK_SIZE */
-		write_size = (total_written + FILE_READ_SIZE) <= DATA_BLOCK_SIZE ? 
-			FILE_READ_SIZE : DATA_BLOCK_SIZE - total_written;  
+	while (total_written < total) { 
+		/* make sure we don't write more than the run */
+		write_size = (total - total_written) < IO_BUF_SIZE(table->db) ? 
+			(total - total_written) : IO_BUF_SIZE(table->db);  
 
 		/* Copy data into the I/O buffer */
-		memcpy(table->db->io_buf[tid()], 
-			(void *)((char *)buf + total_written), write_size); 
+		if (stage_blocks(table, blk_num + total_written / bs, 
+				table->db->io_buf[tid()], bufs + total_written / bs, 
+				write_size / bs))
+			return -1; 
+
 		/* Submit I/O buffer */
-		ocall_write_file(&written, table->fd[tid()], 
+		written = pwrite_block(table->db, table->fd[tid()], 
 			table->db->io_buf[tid()], 
-			write_size);
+			write_size, blk_num*bs + total_written);
 		if (written < 0) {
-#if defined(IO_LOCK)
-			release(&table->db->bcache.iolock); 	
-#endif
 			ERR("write filed\n"); 
 			return written;
 		} 
 		total_written += written;  
 	}
-#if defined(IO_LOCK)
-	release(&table->db->bcache.iolock); 	
+	return 0; 
+}
+
+/* Hand a batch of staged requests to the untrusted AIO service in one 
+   crossing. Returns 1 if they are in flight, 0 if there is no AIO on 
+   this host and they were written one by one, -1 if a write failed */
+static int aio_submit(data_base_t *db, io_req_t *reqs, int n) {
+	int submitted, ret = 0, r; 
+
+	ocall_aio_submit(&submitted, tid(), reqs, n);
+	if (submitted >= 0)
+		return 1; 
+
+	/* No AIO on this host, write them one by one */
+	for (int i = 0; i < n; i++) {
+		r = pwrite_block(db, reqs[i].fd, reqs[i].buf, reqs[i].size, reqs[i].offset); 
+		if (r != (long)reqs[i].size)
+			ret = -1; 
+	}
+	return ret; 
+}
+
+/* Reap the completions of the n requests in flight on our context. 
+   With results a short transfer is stored there instead of failing */
+static int aio_wait(io_req_t *reqs, int n, long *results) {
+	io_cpl_t cpls[IO_AIO_DEPTH]; 
+	unsigned char done[IO_AIO_DEPTH] = {0}; 
+	int reaped = 0, ret = 0, r; 
+	unsigned long id; 
+
+	while (reaped < n) {
+		ocall_aio_reap(&r, tid(), cpls, n - reaped, n - reaped);
+		if (r <= 0 || r > n - reaped) {
+			ERR("reaping async I/O failed:%d\n", r); 
+			return -1; 
+		}
+
+		for (int i = 0; i < r; i++) {
+			/* Completions come from outside, don't trust the ids. 
+			   A repeated id would end the loop while a staged 
+			   buffer is still being written */
+			id = cpls[i].id; 
+			if (id >= (unsigned long)n || done[id]) {
+				ERR("bogus async write completion %lu\n", id); 
+				return -1; 
+			}
+			done[id] = 1; 
+
+			if (results && cpls[i].result >= 0 && cpls[i].result <= (long)reqs[id].size) {
+				results[id] = cpls[i].result; 
+			} else if (cpls[i].result != (long)reqs[id].size) {
+				ERR("async I/O %lu failed:%ld\n", id, cpls[i].result); 
+				ret = -1; 
+			}
+		}
+		reaped += r; 
+	}
+	return ret; 
+}
+
+#if defined(ASYNC_IO)
+/* Read a read-ahead window as up to IO_AIO_READ_SPLIT requests that 
+   the AIO workers serve in parallel. The caller still waits for the 
+   whole window. Returns the bytes read from the start of the window, 
+   like pread */
+static int aio_pread(data_base_t *db, int fd, void *buf, unsigned long size, unsigned long offset) {
+	unsigned long bs = db->bcache.blk_size, chunk, off; 
+	io_req_t reqs[IO_AIO_READ_SPLIT]; 
+	long results[IO_AIO_READ_SPLIT]; 
+	int n = 0, submitted, read = 0; 
+
+	if (db->io_ring || size <= bs)
+		return pread_block(db, fd, buf, size, offset); 
+
+	chunk = (size / bs + IO_AIO_READ_SPLIT - 1) / IO_AIO_READ_SPLIT * bs; 
+	for (off = 0; off < size; off += chunk) {
+		reqs[n].op = IO_OP_READ; 
+		reqs[n].fd = fd; 
+		reqs[n].buf = (char *)buf + off; 
+		reqs[n].size = size - off < chunk ? size - off : chunk; 
+		reqs[n].offset = offset + off; 
+		reqs[n].id = n; 
+		n++; 
+	}
+
+	ocall_aio_submit(&submitted, tid(), reqs, n);
+	if (submitted < 0)
+		return pread_block(db, fd, buf, size, offset); 
+
+	if (aio_wait(reqs, n, results))
+		return -1; 
+
+	/* Stop at the first short read, the window reached the end of 
+	   the file */
+	for (int i = 0; i < n; i++) {
+		read += results[i]; 
+		if (results[i] < (long)reqs[i].size)
+			break; 
+	}
+	return read; 
+}
 #endif
+
+/* Write a batch of staged requests and wait for all of them */
+static int aio_write_batch(data_base_t *db, io_req_t *reqs, int n) {
+	int ret = aio_submit(db, reqs, n); 
+
+	return ret == 1 ? aio_wait(reqs, n, NULL) : ret; 
+}
+
+/* Stage nblks blocks of a run starting at its block done into dst, 
+   and describe their write in req */
+static int stage_write_req(io_req_t *req, io_run_t *run, int done, int nblks, void *dst, int id) {
+	unsigned long bs = run->table->db->bcache.blk_size; 
+
+	if (stage_blocks(run->table, run->blk_num + done, dst, run->bufs + done, nblks))
+		return -1; 
+
+	req->op = IO_OP_WRITE; 
+	req->fd = run->table->fd[tid()]; 
+	req->buf = dst; 
+	req->size = nblks * bs; 
+	req->offset = (run->blk_num + done) * bs; 
+	req->id = id; 
 	return 0; 
 }
 
+/* Write several runs of blocks back to disk. With ASYNC_IO as many 
+   runs as fit into the thread's staging slice are submitted as one 
+   batch, so a flush set costs a couple of crossings per slice instead 
+   of one per run. The AIO workers write the runs of a batch in 
+   parallel, the caller waits until all of them are done */
+int write_data_runs(io_run_t *runs, int nruns) {
+	int ret; 
+
+	if (!nruns)
+		return 0; 
+
+#if defined(ASYNC_IO)
+	data_base_t *db = runs[0].table->db; 
+	unsigned long bs = db->bcache.blk_size; 
+	io_req_t reqs[IO_AIO_DEPTH]; 
+	unsigned long staged = 0, k; 
+	int n = 0; 
+
+	if (db->io_ring)
+		goto sync; 
+
+	if(tid() >= IO_THREADS_PER_DB) {
+		ERR("tid():%d >= IO_THREADS_PER_DB (%d)\n", tid(), IO_THREADS_PER_DB); 
+		return -1; 
+	}
+
+	for (int i = 0; i < nruns; i++) {
+		for (int done = 0; done < runs[i].nblks; done += k) {
+			k = (IO_BUF_SIZE(db) - staged) / bs; 
+			if (k > (unsigned long)(runs[i].nblks - done))
+				k = runs[i].nblks - done; 
+
+			/* Staging or the batch is full, write it out */
+			if (!k || n == IO_AIO_DEPTH) {
+				ret = aio_write_batch(db, reqs, n); 
+				if (ret)
+					return ret; 
+				staged = 0; 
+				n = 0; 
+				k = 0; 
+				continue; 
+			}
+
+			if (stage_write_req(&reqs[n], &runs[i], done, k, 
+					(char *)db->io_buf[tid()] + staged, n))
+				return -1; 
+			n++; 
+			staged += k * bs; 
+		}
+	}
+	return n ? aio_write_batch(db, reqs, n) : 0; 
+
+sync:
+#endif
+	for (int i = 0; i < nruns; i++) {
+		ret = write_data_blocks(runs[i].table, runs[i].blk_num, runs[i].bufs, runs[i].nblks);
+		if (ret)
+			return ret; 
+	}
+	return 0; 
+}
+
+#if defined(ASYNC_IO)
+/* Write-behind batches for the flusher. A batch is staged in its own 
+   untrusted buffer, so the next one can be collected and sealed while 
+   the workers write this one out */
+int io_batch_init(io_batch_t *batch, unsigned long blk_size) {
+	unsigned long size = IO_BATCH_BLKS * blk_size; 
+
+	memset(batch, 0, sizeof(*batch)); 
+
+	ocall_alloc_io_buf(&batch->buf, size);
+	if (!batch->buf)
+		return -ENOMEM; 
+
+	if (!sgx_is_outside_enclave(batch->buf, size)) {
+		ERR("io batch buffer is inside the enclave\n"); 
+		batch->buf = NULL; 
+		return -1; 
+	}
+	return 0; 
+}
+
+void io_batch_free(io_batch_t *batch) {
+	if (batch->buf)
+		ocall_free_io_buf(batch->buf);
+	batch->buf = NULL; 
+}
+
+/* Stage runs of at most IO_BATCH_BLKS blocks in all, all of the same 
+   database, into the batch. The caller submits them with 
+   write_batch_submit() */
+int write_batch_stage(io_batch_t *batch, io_run_t *runs, int nruns) {
+	unsigned long bs, staged = 0; 
+
+	if (tid() >= IO_THREADS_PER_DB) {
+		ERR("tid():%d >= IO_THREADS_PER_DB (%d)\n", tid(), IO_THREADS_PER_DB); 
+		return -1; 
+	}
+
+	batch->n = 0; 
+	if (!nruns)
+		return 0; 
+
+	batch->db = runs[0].table->db; 
+	bs = batch->db->bcache.blk_size; 
+	for (int i = 0; i < nruns; i++) {
+		if (staged / bs + runs[i].nblks > IO_BATCH_BLKS) {
+			ERR("io batch overflow\n"); 
+			return -1; 
+		}
+
+		if (stage_write_req(&batch->reqs[batch->n], &runs[i], 0, runs[i].nblks, 
+				(char *)batch->buf + staged, batch->n))
+			return -1; 
+		batch->n++; 
+		staged += runs[i].nblks * bs; 
+	}
+	return 0; 
+}
+
+/* Start writing a staged batch, returns without waiting for it unless 
+   there is no AIO on this host or an I/O ring is attached */
+int write_batch_submit(io_batch_t *batch) {
+	int ret = 0; 
+
+	batch->inflight = 0; 
+	if (!batch->n)
+		return 0; 
+
+	if (batch->db->io_ring) {
+		for (int i = 0; i < batch->n; i++) {
+			if (pwrite_block(batch->db, batch->reqs[i].fd, batch->reqs[i].buf, 
+					batch->reqs[i].size, batch->reqs[i].offset) != (long)batch->reqs[i].size)
+				ret = -1; 
+		}
+		return ret; 
+	}
+
+	ret = aio_submit(batch->db, batch->reqs, batch->n); 
+	if (ret == 1) {
+		batch->inflight = 1; 
+		ret = 0; 
+	}
+	return ret; 
+}
+
+/* Wait for a submitted batch to be written */
+int write_batch_wait(io_batch_t *batch) {
+	if (!batch->inflight)
+		return 0; 
+
+	batch->inflight = 0; 
+	return aio_wait(batch->reqs, batch->n, NULL); 
+}
+#endif
+
+/* Write data block from enclave's memory back to disk. 
+ * For temporary results, we'll create temporary tables that will 
+ * have corresponding encryption keys (huh?)
+*/
+int write_data_block(table *table, unsigned long blk_num, void *buf) {
+	return write_data_blocks(table, blk_num, &buf, 1); 
+}
+
 /*
  *
  * Public DB interace, i.e., something clients can invoke
  *
  */
 
-/* Create data base, returns dbId */
+/* Create data base, returns dbId. blk_size is the size of its data 
+   blocks, a power of two between DATA_BLOCK_SIZE_MIN and _MAX, and 
+   cache_blks the number of blocks its buffer cache holds; 0 picks 
+   the defaults (DATA_BLOCK_SIZE and DATA_BLKS_PER_DB) */
 /* TODO: check for duplicate table name */
-int ecall_create_db(const char *cname, int name_len, int *db_id) {
+int ecall_create_db(const char *cname, int name_len, unsigned long blk_size, 
+		    unsigned int cache_blks, int *db_id) {
 
 	data_base *db;
 	int i, ret; 
@@ -300,6 +713,23 @@ int ecall_create_db(const char *cname, int name_len, int *db_id) {
 	if (!cname || (name_len == 0) || !db_id)
 		return -1;  
 
+	if (!blk_size)
+		blk_size = DATA_BLOCK_SIZE; 
+	if (!cache_blks)
+		cache_blks = DATA_BLKS_PER_DB; 
+
+	if (blk_size < DATA_BLOCK_SIZE_MIN || blk_size > DATA_BLOCK_SIZE_MAX || 
+	    (blk_size & (blk_size - 1))) {
+		ERR("bad block size %lu\n", blk_size); 
+		return -EINVAL; 
+	}
+
+	cache_blks -= cache_blks % BCACHE_SHARDS; 
+	if (cache_blks < 2 * BCACHE_SHARDS || cache_blks > DATA_BLKS_MAX) {
+		ERR("bad number of cache blocks %u\n", cache_blks); 
+		return -EINVAL; 
+	}
+
 	/* Look up an empty DB slot */
 	for (i = 0; i < MAX_DATABASES; i++) {
 		if(!g_dbs[i])
@@ -314,12 +744,13 @@ int ecall_create_db(const char *cname, int name_len, int *db_id) {
 		return -ENOMEM;
 	
 	db->name = name;
+	db->io_ring = NULL; 
 
 	g_dbs[i] = db;
 	*db_id = i; 
 
 	/* Allocate data blocks */
-	ret = alloc_data_blocks(db);
+	ret = alloc_data_blocks(db, blk_size, cache_blks);
 	if (ret)
 		goto cleanup;
 
@@ -348,7 +779,9 @@ int ecall_free_db(int db_id) {
 		return -EINVAL;  
 	}
 
-	
+	/* Flusher would be writing blocks of the tables we free */
+	bflusher_stop(&db->bcache);
+
 	/* Free all tables */
 	for (auto i = 0; i < MAX_TABLES; i++) {
 		if(db->tables[i]) {
@@ -406,7 +839,38 @@ int create_table(data_base_t *db, std::string &name, schema_t *schema, table_t *
 	table->num_blks = 0; 
 	table->db = db; 
 	table->pinned_blocks = NULL; 
-	table->rows_per_blk = DATA_BLOCK_SIZE / row_size(table); 
+	table->num_pinned = 0; 
+	table->rows_per_blk = BLOCK_DATA_SIZE(db->bcache.blk_size) / row_size(table); 
+	if (!table->rows_per_blk) {
+		ERR("rows of %s don't fit into %lu byte blocks\n", name.c_str(), db->bcache.blk_size); 
+		ret = -EINVAL; 
+		goto cleanup; 
+	}
+	table->ra_next = 0; 
+	table->bprio = BPRIO_NORMAL; 
+	table->bquota = 0; 
+	table->bcached = 0; 
+
+#if defined(SEAL_BLOCKS)
+	if (seal_init(table)) {
+		ret = -6; 
+		goto cleanup; 
+	}
+#endif
+
+	table->qsort = NULL; 
+	if (qsort_shared_init(table)) {
+		ret = -ENOMEM; 
+		goto cleanup; 
+	}
+
+	table->merkle = NULL; 
+#if defined(BLOCK_FRESHNESS)
+	if (merkle_init(table)) {
+		ret = -7; 
+		goto cleanup; 
+	}
+#endif
 
 	/* Call outside of enclave to open a file for the table */
 	sgx_ret = ocall_open_file(&fd, name.c_str());
@@ -414,8 +878,19 @@ int create_table(data_base_t *db, std::string &name, schema_t *schema, table_t *
 		ret = -5;
 		goto cleanup; 
 	} 
+
+#if defined(SEAL_BLOCKS)
+	/* A file left over from an earlier run was sealed under another 
+	   key and its blocks would fail to unseal */
+	sgx_ret = ocall_truncate_file(&ret, fd);
+	if (sgx_ret || ret < 0) {
+		ocall_close_file(&ret, fd); 
+		ret = -5;
+		goto cleanup; 
+	} 
+#endif
 	
-	for (i = 0; i < THREADS_PER_DB; i++) {
+	for (i = 0; i < IO_THREADS_PER_DB; i++) {
 		/* Call outside of enclave to open a file for the table */
 		//sgx_ret = ocall_open_file(&fd, name.c_str());
 		//if (sgx_ret || fd < 0) {
@@ -432,6 +907,9 @@ int create_table(data_base_t *db, std::string &name, schema_t *schema, table_t *
 	return 0;
 
 cleanup:
+	merkle_free(table); 
+	seal_free(table); 
+	qsort_shared_free(table); 
 	delete table;
 	db->tables[i] = NULL; 
 	return ret; 
@@ -471,6 +949,9 @@ void free_table(table_t *table) {
 		} 
 	}
 
+	merkle_free(table); 
+	seal_free(table); 
+	qsort_shared_free(table); 
 	delete table;
 	return; 
 }
@@ -482,6 +963,8 @@ int delete_table(data_base_t *db, table_t *table) {
 	
 	db->tables[table->id] = NULL;
 
+	// Don't let stale blocks of this table linger in the cache
+	binval(table); 
 
 	for(int i = 0; i < 1 /* THREADS_PER_DB*/; i++) {
 		sgx_ret = ocall_close_file(&ret, table->fd[i]);
@@ -498,6 +981,9 @@ int delete_table(data_base_t *db, table_t *table) {
 		ret = sgx_ret;
 	} 
 
+	merkle_free(table); 
+	seal_free(table); 
+	qsort_shared_free(table); 
 	delete table;
 	return ret; 
 
@@ -522,6 +1008,45 @@ int ecall_flush_table(int db_id, int table_id) {
 
 };
 
+/* Switch block I/O of a DB to an exitless I/O ring serviced by untrusted 
+   workers, or back to ocalls if ring is NULL. No I/O may be in flight */
+int ecall_io_ring_attach(int db_id, void *ring) {
+	data_base_t *db;
+
+	if (!(db = get_db(db_id)))
+		return -1;
+
+	if (ring && !sgx_is_outside_enclave(ring, sizeof(io_ring_t))) {
+		ERR("io ring must be in untrusted memory\n"); 
+		return -EINVAL; 
+	}
+
+	db->io_ring = (io_ring_t *)ring; 
+	return 0;
+};
+
+/* Run the buffer cache write-back thread, returns once 
+   ecall_bcache_flusher_stop() is called */
+int ecall_bcache_flusher(int db_id) {
+	data_base_t *db;
+
+	if (!(db = get_db(db_id)))
+		return -1;
+
+	thread_id = FLUSHER_TID; 
+	return bflusher(&db->bcache);
+};
+
+/* Stop the write-back thread, -EAGAIN if it isn't running (yet) */
+int ecall_bcache_flusher_stop(int db_id) {
+	data_base_t *db;
+
+	if (!(db = get_db(db_id)))
+		return -1;
+
+	return bflusher_stop(&db->bcache);
+};
+
 /* Insert one row */
 int ecall_insert_row(int db_id, int table_id, void *row_data) {
 
@@ -543,6 +1068,8 @@ bool compare_rows(schema_t *sc, int column, row_t *row_l, row_t *row_r) {
 	/* make sure fake touples are always greater */
 	if (row_l->header.fake)
 		return true; 
+	if (row_r->header.fake)
+		return false; 
 
 	switch(sc->types[column]) {
 	case BOOLEAN:
@@ -689,44 +1216,59 @@ int join_schema_algo(schema_t *sc, schema_t *left, schema_t *right,
 	return 0;
 }
 
-/* Pin table in buffer cache  */
+/* Pin as much of the table in the buffer cache as it lets us, from the 
+   first block on. Returns the number of blocks pinned, get_pinned_row() 
+   reads the rest through the cache */
 int pin_table(table_t *table) {
 
 	unsigned long blk_num;
 	unsigned long number_of_blks; 
 	data_block_t *b;
 
-	ERR_ON(table->num_rows == 0, 
-		"Nothing to pin, table:%s empty\n", table->name.c_str()); 
-
-	number_of_blks = table->num_rows / table->rows_per_blk + 1; 
+	number_of_blks = (table->num_rows + table->rows_per_blk - 1) / table->rows_per_blk; 
 
-	table->pinned_blocks = (data_block_t **) malloc(number_of_blks*sizeof(data_block_t*)); 
+	table->num_pinned = 0; 
+	table->pinned_blocks = (data_block_t **) malloc((number_of_blks + 1)*sizeof(data_block_t*)); 
 
 	if (!table->pinned_blocks)
 		return -ENOMEM;
 
-	for(blk_num = 0; blk_num*table->rows_per_blk < table->num_rows; blk_num++) 
+	for(blk_num = 0; blk_num < number_of_blks; blk_num++) 
 	{
 		DBG_ON(PIN_VERBOSE, "pin:%s, blk_num: %d\n", table->name.c_str(), blk_num);
 
-        	b = bread(table, blk_num);
-		ERR_ON(!b, "got NULL block"); 
+		b = bread(table, blk_num, BH_PIN);
+		if (!b)
+			break; 
 		table->pinned_blocks[blk_num] = b; 
 	} 	
-	return 0; 
+	table->num_pinned = blk_num; 
+
+	DBG_ON(PIN_VERBOSE, "pinned %lu of %lu blocks of %s\n", 
+		blk_num, number_of_blks, table->name.c_str());
+	return blk_num; 
 }
 
-/* Unpin table in buffer cache  */
+/* Unpin table in buffer cache, its blocks are marked dirty */
 int unpin_table_dirty(table_t *table) {
 
 	unsigned long blk_num;
 
-	for(blk_num = 0; blk_num*table->rows_per_blk < table->num_rows; blk_num++) 
-	{ 
+	for(blk_num = 0; blk_num < table->num_pinned; blk_num++) 
 		bwrite(table->pinned_blocks[blk_num]); 
-		brelse(table->pinned_blocks[blk_num]); 
-	} 
+
+	return unpin_table(table); 
+}
+
+/* Unpin table without marking its blocks dirty, for a table whose 
+   contents are dropped next */
+int unpin_table(table_t *table) {
+
+	unsigned long blk_num;
+
+	for(blk_num = 0; blk_num < table->num_pinned; blk_num++) 
+		bunpin(table->pinned_blocks[blk_num]); 
+	table->num_pinned = 0; 
 	
 	if (table->pinned_blocks) {
 		free(table->pinned_blocks);
@@ -783,6 +1325,7 @@ int ecall_join(int db_id, join_condition_t *c, int *join_table_id) {
 	int ret;
 	data_base_t *db;
 	table_t *tbl_left, *tbl_right, *join_table;
+	table_appender_t app; 
 	row_t *row_left = NULL, *row_right = NULL, *join_row = NULL;
 	schema_t join_sc;
 	std::string join_table_name;  
@@ -810,6 +1353,7 @@ int ecall_join(int db_id, join_condition_t *c, int *join_table_id) {
 	}
 
 	*join_table_id = join_table->id; 
+	appender_open(&app, join_table); 
 
 	DBG("Created join table %s, id:%d\n", join_table_name.c_str(), join_table_id); 
 
@@ -898,7 +1442,7 @@ int ecall_join(int db_id, join_condition_t *c, int *join_table_id) {
 				}
 			
 				/* Add row to the join */
-				ret = insert_row_dbg(join_table, join_row);
+				ret = append_row(&app, join_row);
 				if(ret) {
 					ERR("failed to join row %d of table %s with row %d of table %s\n",
 						i, tbl_left->name.c_str(), j, tbl_right->name.c_str());
@@ -909,10 +1453,12 @@ int ecall_join(int db_id, join_condition_t *c, int *join_table_id) {
 		}
 	}
 
+	appender_close(&app); 
 	bflush(join_table); 
 
 	ret = 0;
 cleanup: 
+	appender_close(&app); 
 	if (join_row)
 		free(join_row); 
 	
@@ -982,6 +1528,8 @@ int promote_table(data_base_t *db, table_t *tbl, int column, table_t **p_tbl) {
 	std::string p_tbl_name;  
         schema_t p_sc;
 	row_t *row_old, *row_new; 
+	table_cursor_t c; 
+	table_appender_t app; 
 
 	p_tbl_name = "p:" + tbl->name; 
 
@@ -1008,10 +1556,12 @@ int promote_table(data_base_t *db, table_t *tbl, int column, table_t **p_tbl) {
 	if(!row_new)
 		return -ENOMEM;
 
+	cursor_open(&c, tbl, 0, BH_SEQ); 
+	appender_open(&app, *p_tbl); 
 	for (unsigned int i = 0; i < tbl->num_rows; i ++) {
 
 		// Read old row
-		ret = read_row(tbl, i, row_old);
+		ret = cursor_next(&c, row_old);
 		if(ret) {
 			ERR("failed to read row %d of table %s\n",
 				i, tbl->name.c_str());
@@ -1028,7 +1578,7 @@ int promote_table(data_base_t *db, table_t *tbl, int column, table_t **p_tbl) {
 		}
 
 		/* Add row to the promoted table */
-		ret = insert_row_dbg(*p_tbl, row_new);
+		ret = append_row(&app, row_new);
 		if(ret) {
 			ERR("failed to insert row %d of promoted table %s\n",
 				i, (*p_tbl)->name.c_str());
@@ -1037,10 +1587,14 @@ int promote_table(data_base_t *db, table_t *tbl, int column, table_t **p_tbl) {
 
 	}
 
+	appender_close(&app); 
 	bflush(*p_tbl); 
 
 	ret = 0;
 cleanup: 
+	cursor_close(&c); 
+	appender_close(&app); 
+
 	if (row_old)
 		free(row_old); 
 
@@ -1056,7 +1610,7 @@ cleanup:
  *
  */
 /* Read one row. */
-int read_row(table_t *table, unsigned int row_num, row_t *row) {
+static int read_row_hint(table_t *table, unsigned int row_num, row_t *row, int hint) {
 
 	unsigned long dblk_num;
 	unsigned long row_off; 
@@ -1074,7 +1628,7 @@ int read_row(table_t *table, unsigned int row_num, row_t *row) {
 	/* Offset of the row within the data block in bytes */
 	row_off = (row_num - dblk_num * table->rows_per_blk) * row_size(table); 
 	
-        b = bread(table, dblk_num);
+        b = bread(table, dblk_num, hint);
 	ERR_ON(!b, "got NULL block"); 
 
 	/* Copy the row into the data block */
@@ -1084,6 +1638,97 @@ int read_row(table_t *table, unsigned int row_num, row_t *row) {
 	return 0; 
 }
 
+int read_row(table_t *table, unsigned int row_num, row_t *row) {
+	return read_row_hint(table, row_num, row, BH_NORMAL); 
+}
+
+/* Same as read_row() but for scans that touch each row once, lets 
+   the buffer cache keep the table's blocks from pushing out hot ones */
+int read_row_seq(table_t *table, unsigned int row_num, row_t *row) {
+	return read_row_hint(table, row_num, row, BH_SEQ); 
+}
+
+static int get_row_handle_hint(table_t *table, unsigned int row_num, row_handle_t *h, int hint) {
+	unsigned long dblk_num;
+	unsigned long row_off; 
+
+	dblk_num = row_num / table->rows_per_blk;
+
+	/* Offset of the row within the data block in bytes */
+	row_off = (row_num - dblk_num * table->rows_per_blk) * row_size(table); 
+
+	if (!h->b || h->b->table != table || h->b->blk_num != dblk_num) {
+		put_row_handle(h); 
+
+		if (row_pinned(table, row_num)) {
+			h->b = table->pinned_blocks[dblk_num]; 
+			h->pinned = 1; 
+		} else {
+			h->b = bread(table, dblk_num, hint);
+			if (!h->b) {
+				ERR("failed to read block %lu of table %s\n", 
+					dblk_num, table->name.c_str()); 
+				return -1; 
+			}
+		}
+	}
+
+	h->row = (row_t*) ((char*)h->b->data + row_off); 
+	return 0; 
+}
+
+/* Point the handle at row row_num in place, releasing the block it 
+   held unless the row is in the same one */
+int get_row_handle(table_t *table, unsigned int row_num, row_handle_t *h) {
+	return get_row_handle_hint(table, row_num, h, BH_NORMAL); 
+}
+
+/* Drop the handle's block, marking it dirty if a row was changed */
+void put_row_handle(row_handle_t *h) {
+	if (!h->b)
+		return; 
+
+	if (!h->pinned) {
+		if (h->dirty)
+			bwrite(h->b);
+		brelse(h->b);
+	}
+	init_row_handle(h); 
+}
+
+/* Start reading the table at row row_num */
+void cursor_open(table_cursor_t *c, table_t *table, unsigned long row_num, int hint) {
+	c->table = table; 
+	c->row_num = row_num; 
+	c->hint = hint; 
+	init_row_handle(&c->h); 
+}
+
+/* Copy the next row out */
+int cursor_next(table_cursor_t *c, row_t *row) {
+	int ret; 
+
+	if (c->row_num >= c->table->num_rows) {
+		/* Past the end, don't hold on to the last block */
+		put_row_handle(&c->h); 
+		row->header.fake = true; 
+		c->row_num++; 
+		return 0;
+	}
+
+	ret = get_row_handle_hint(c->table, c->row_num, &c->h, c->hint); 
+	if (ret)
+		return ret; 
+
+	memcpy(row, c->h.row, row_size(c->table)); 
+	c->row_num++; 
+	return 0; 
+}
+
+void cursor_close(table_cursor_t *c) {
+	put_row_handle(&c->h); 
+}
+
 int write_row_dbg(table_t *table, row_t *row, unsigned int __row_num) {
 	unsigned long dblk_num;
 	unsigned long row_off; 
@@ -1114,7 +1759,7 @@ int write_row_dbg(table_t *table, row_t *row, unsigned int __row_num) {
 	/* Offset of the row within the data block in bytes */
 	row_off = (row_num - dblk_num * table->rows_per_blk) * row_size(table); 
 	
-        b = bread(table, dblk_num);
+        b = bread(table, dblk_num, BH_NORMAL);
 	ERR_ON(!b, "got NULL block"); 
 
 	/* Copy the row into the data block */
@@ -1146,7 +1791,7 @@ int insert_row_dbg(table_t *table, row_t *row) {
 	/* Offset of the row within the data block in bytes */
 	row_off = (row_num - dblk_num * table->rows_per_blk) * row_size(table); 
 	
-        b = bread(table, dblk_num);
+        b = bread(table, dblk_num, BH_NORMAL);
 	ERR_ON(!b, "got NULL block"); 
 
 	/* Copy the row into the data block */
@@ -1159,6 +1804,65 @@ int insert_row_dbg(table_t *table, row_t *row) {
 
 }
 
+void appender_open(table_appender_t *a, table_t *table) {
+	a->table = table; 
+	a->b = NULL; 
+	a->row_num = table->num_rows; 
+}
+
+/* Publish the rows of the block being filled and let it go */
+static void appender_flush(table_appender_t *a) {
+	table_t *table = a->table; 
+	unsigned long used; 
+
+	if (!a->b)
+		return; 
+
+	/* Don't leave stale data behind the last row */
+	used = (a->row_num - a->b->blk_num * table->rows_per_blk) * row_size(table); 
+	memset((char*)a->b->data + used, 0, BLOCK_DATA_SIZE(table->db->bcache.blk_size) - used); 
+
+	table->num_rows = a->row_num; 
+	bwrite(a->b);
+	brelse(a->b);
+	a->b = NULL; 
+}
+
+int append_row(table_appender_t *a, row_t *row) {
+	table_t *table = a->table; 
+	unsigned long dblk_num;
+	unsigned long row_off; 
+
+	dblk_num = a->row_num / table->rows_per_blk;
+
+	/* Offset of the row within the data block in bytes */
+	row_off = (a->row_num - dblk_num * table->rows_per_blk) * row_size(table); 
+
+	if (!a->b) {
+		/* Only a block that already holds rows needs reading */
+		if (row_off)
+			a->b = bread(table, dblk_num, BH_NORMAL);
+		else
+			a->b = bnew(table, dblk_num);
+		if (!a->b) {
+			ERR("failed to get block %lu of table %s\n", 
+				dblk_num, table->name.c_str()); 
+			return -1; 
+		}
+	}
+
+	memcpy((char*)a->b->data + row_off, row, row_size(table)); 
+	a->row_num++; 
+
+	if (a->row_num % table->rows_per_blk == 0)
+		appender_flush(a); 
+	return 0; 
+}
+
+void appender_close(table_appender_t *a) {
+	appender_flush(a); 
+}
+
 /* Insert one row. This one is not oblivious, will insert 
    a row at the very end of the table which is pointed by 
    table->num_rows 
@@ -1192,6 +1896,57 @@ int ecall_insert_row_dbg(int db_id, int table_id, void *row_data) {
 	return ret; 
 }
 
+/* Bulk insert for loading from the host. rows holds num_rows rows 
+   packed back to back in untrusted memory, data_size bytes each (the 
+   host's schema, the table may be padded past it). They go through an 
+   appender so each block is written once */
+int ecall_insert_rows(int db_id, int table_id, void *rows, int data_size, int num_rows) {
+
+	data_base_t *db;
+	table_t *table;
+	table_appender_t app; 
+	row_t *row;
+	int ret = 0; 
+
+	if (!(db = get_db(db_id)) || !rows || num_rows < 0)
+		return -1; 
+	
+	if ((table_id > (MAX_TABLES - 1)) || !db->tables[table_id])
+		return -2; 
+
+	table = db->tables[table_id];
+
+	if (data_size <= 0 || data_size > row_data_size(table)) {
+		ERR("row size %d doesn't fit table %s\n", data_size, table->name.c_str()); 
+		return -1; 
+	}
+
+	if (!sgx_is_outside_enclave(rows, (size_t)num_rows * data_size)) {
+		ERR("rows buffer isn't in untrusted memory\n"); 
+		return -1; 
+	}
+
+	row = (row_t*) malloc(row_size(table)); 
+	if(!row)
+		return -ENOMEM;
+
+	memset(row, 0, row_size(table)); 
+	row->header.fake = false;
+	row->header.from = table_id;
+
+	appender_open(&app, table); 
+	for (int i = 0; i < num_rows; i++) {
+		memcpy(row->data, (char*)rows + (size_t)i * data_size, data_size); 
+		ret = append_row(&app, row); 
+		if (ret) 
+			break; 
+	}
+	appender_close(&app); 
+
+	free(row); 
+	return ret; 
+}
+
 void print_schema(schema_t *sc, std::string name)
 {
 	auto total_sz = 0u;
@@ -1259,6 +2014,7 @@ void print_row(schema_t *sc, row_t *row) {
 int scan_table_dbg(table_t *table) {
 	unsigned long i;
 	row_t *row;
+	table_cursor_t c; 
 
 	printf("scan table:%s with %lu rows\n", 
 		table->name.c_str(), table->num_rows.load()); 
@@ -1272,12 +2028,14 @@ int scan_table_dbg(table_t *table) {
 	unsigned long long start, end; 
 	start = RDTSC();
 
+	cursor_open(&c, table, 0, BH_SEQ); 
 	for (i = 0; i < table->num_rows; i++) {
 	
 		/* Read one row. */
-		read_row(table, i, row);
+		cursor_next(&c, row);
 
 	}
+	cursor_close(&c); 
 	
 	end = RDTSC();
 	unsigned long long cycles = end - start;
@@ -1433,6 +2191,8 @@ int project_promote_pad_table(
     std::string p3_tbl_name;
     schema_t project_sc, project_promote_sc, project_promote_pad_sc;
     row_t *row_old, *row_new, *row_new2;
+    table_cursor_t c;
+    table_appender_t app;
     p3_tbl_name = "p3:" + tbl->name;
 
     ret = project_schema(&tbl->sc, 
@@ -1476,9 +2236,11 @@ int project_promote_pad_table(
     if(!row_new2)
 	    return -ENOMEM;
 
+    cursor_open(&c, tbl, 0, BH_SEQ);
+    appender_open(&app, *p3_tbl);
     for (unsigned int i = 0; i < tbl->num_rows; i++) {
         // Read original row
-        ret = read_row(tbl, i, row_old);
+        ret = cursor_next(&c, row_old);
         if(ret) {
             ERR("read_row failed on row %d of table %s\n", i, tbl->name.c_str());
             goto cleanup;
@@ -1499,7 +2261,7 @@ int project_promote_pad_table(
         }
 
         // Add row to table
-        ret = insert_row_dbg(*p3_tbl, row_new2);
+        ret = append_row(&app, row_new2);
         if(ret) {
             ERR("insert_row_db failed on row %d of table %s\n", i,
                 (*p3_tbl)->name.c_str());
@@ -1507,12 +2269,16 @@ int project_promote_pad_table(
         }
     }
 
+    appender_close(&app);
     bflush(*p3_tbl);
 	*p2_schema = project_promote_sc;
     *p3_schema = project_promote_pad_sc;
     ret = 0;
 
 cleanup:
+    cursor_close(&c);
+    appender_close(&app);
+
     if (row_old)
         free(row_old);
 
@@ -1545,6 +2311,8 @@ int ecall_merge_and_sort_and_write(int db_id,
 
 	table_t *p3_tbl_left, *p3_tbl_right, *append_table;
 	row_t *row_left = NULL, *row_right = NULL;
+	table_cursor_t cur; 
+	table_appender_t app; 
 	schema_t append_sc, join_sc, p3_left_schema, p3_right_schema, p2_left_schema, p2_right_schema;
 	std::string append_table_name;  
 	int append_table_id;
@@ -1653,23 +2421,31 @@ int ecall_merge_and_sort_and_write(int db_id,
 	start = RDTSC();
 #endif
 
+	cursor_open(&cur, p3_tbl_left, 0, BH_SEQ); 
+	appender_open(&app, append_table); 
 	for(int i=0; i < p3_tbl_left->num_rows; i ++)
 	{
-		ret = read_row(p3_tbl_left, i, row_left);
+		ret = cursor_next(&cur, row_left);
 		if(ret) {
 			ERR("failed to read row %d of table %s\n",
 				i, tbl_left->name.c_str());
+			cursor_close(&cur); 
+			appender_close(&app); 
 			goto cleanup;
 		}
 
 		/* Add left row to the append table */
-		ret = insert_row_dbg(append_table, row_left);
+		ret = append_row(&app, row_left);
 		if(ret) {
 			ERR("failed to append row %d of table %s to %s table\n",
 				i, p3_tbl_left->name.c_str(), append_table->name.c_str());
+			cursor_close(&cur); 
+			appender_close(&app); 
 			goto cleanup;
 		}
 	}
+	cursor_close(&cur); 
+	appender_close(&app); 
 
 #if defined(REPORT_APPEND_STATS)
 	end = RDTSC();
@@ -1822,6 +2598,7 @@ int join_and_write_sorted_table(data_base_t *db, table_t *tbl, join_condition_t
 	int ret;
 	table_t *tbl_left, *tbl_right, *join_table;
 	row_t *row_left = NULL, *row_right = NULL, *join_row = NULL;
+	table_appender_t app; 
 	std::string join_table_name;  
 
 	if (!c)	
@@ -1846,6 +2623,7 @@ int join_and_write_sorted_table(data_base_t *db, table_t *tbl, join_condition_t
 	}
 
 	*join_table_id = join_table->id; 
+	appender_open(&app, join_table); 
 
 	DBG("Created join table %s, id:%d\n", join_table_name.c_str(), *join_table_id); 
 
@@ -1894,7 +2672,7 @@ int join_and_write_sorted_table(data_base_t *db, table_t *tbl, join_condition_t
 				join_row->header.fake = true; 
 
 				// Add a fake row to the join table
-				ret = insert_row_dbg(join_table, join_row);
+				ret = append_row(&app, join_row);
 				if(ret) {
 					ERR("failed to insert fake row %d of table %s with row %d of table %s\n",
 						i, tbl_left->name.c_str(), j, tbl_right->name.c_str());
@@ -1940,7 +2718,7 @@ int join_and_write_sorted_table(data_base_t *db, table_t *tbl, join_condition_t
 					}
 				
 					// Add row to the join 
-					ret = insert_row_dbg(join_table, join_row);
+					ret = append_row(&app, join_row);
 					if (ret) {
 						ERR("failed to join row %d of table %s with row %d of table %s\n",
 							i, tbl_left->name.c_str(), j, tbl_right->name.c_str());
@@ -1951,7 +2729,7 @@ int join_and_write_sorted_table(data_base_t *db, table_t *tbl, join_condition_t
 					join_row->header.fake = true;
 
 					// Add a fake row to the join table
-					ret = insert_row_dbg(join_table, join_row);
+					ret = append_row(&app, join_row);
 					if (ret) {
 						ERR("failed to insert fake row %d of table %s with row %d of table %s\n",
 							i, tbl_left->name.c_str(), j, tbl_right->name.c_str());
@@ -1962,6 +2740,7 @@ int join_and_write_sorted_table(data_base_t *db, table_t *tbl, join_condition_t
 		}
 	}
 
+	appender_close(&app);
 	bflush(join_table);
 
 	print_table_dbg(join_table, 0, 135);
@@ -1969,6 +2748,7 @@ int join_and_write_sorted_table(data_base_t *db, table_t *tbl, join_condition_t
 	ret = 0;
 
 cleanup:
+	appender_close(&app);
 	if (join_row)
 		free(join_row);
 
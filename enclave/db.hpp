@@ -5,6 +5,9 @@
 
 #include "dbg.hpp"
 #include "bcache.hpp"
+#include "io_ring.hpp"
+#include "seal.hpp"
+#include "merkle.hpp"
 
 #define MAX_DATABASES 10
 #define MAX_ROWS (1 << 20) /* 1 M for now */
@@ -13,6 +16,16 @@
 #define MAX_COLS 20
 #define MAX_CONDITIONS 3 // number of ORs allowed in one clause of a condition
 #define THREADS_PER_DB 8 // number of threads concurrently working on DB
+#define FLUSHER_TID THREADS_PER_DB // tid of the bcache write-back thread
+#define IO_THREADS_PER_DB (THREADS_PER_DB + 1) // threads doing I/O, workers + flusher
+
+#if IO_RING_SLOTS < IO_THREADS_PER_DB
+#error "IO ring needs a slot per I/O thread"
+#endif
+
+#if IO_AIO_CTXS < IO_THREADS_PER_DB
+#error "AIO service needs a context per I/O thread"
+#endif
 
 int reserve_tid();
 void reset_tids();
@@ -83,9 +96,19 @@ typedef struct table {
 	std::atomic_uint num_rows;    /* Number of rows in the table (used only 
 					 for bulk insertion) */
 	unsigned long num_blks;   /* Number of blocks allocated */
-	int fd [THREADS_PER_DB];  /* File descriptor backing up the table data */
+	int fd [IO_THREADS_PER_DB];  /* File descriptor backing up the table data */
 	data_block_t **pinned_blocks; 
+	unsigned long num_pinned; /* Leading blocks of the table in pinned_blocks */
 	unsigned long rows_per_blk; 
+	unsigned long ra_next;    /* Block that continues the sequential read stream */
+	unsigned char seal_key[SEAL_KEY_SIZE]; /* Key sealing the table's blocks on disk */
+	unsigned long seal_seq;   /* Next write sequence number, part of the nonce */
+	seal_written_t seal_written; /* Blocks sealed so far */
+	merkle_t *merkle;         /* Freshness tree over the sealed blocks */
+	struct qsort_shared *qsort; /* Shared by the threads of a parallel quicksort */
+	int bprio;                /* BPRIO_* class of the table's cached blocks */
+	unsigned int bquota;      /* Most blocks it may keep cached, 0 no limit */
+	volatile unsigned int bcached; /* Blocks it has cached */
 	struct data_base *db; 
 } table_t;
 
@@ -94,7 +117,10 @@ typedef struct data_base {
 	std::string name;
 	table_t *tables[MAX_TABLES];
 	bcache_t bcache;
-	void *io_buf[THREADS_PER_DB]; /* each thread has an I/O buffer */
+	void *staging; /* untrusted I/O staging arena */
+	void *io_buf[IO_THREADS_PER_DB]; /* each thread's slice of the arena */
+	io_ring_t *io_ring; /* exitless I/O ring in untrusted memory, 
+			       NULL to do block I/O with ocalls */
 } data_base_t;
 
 // One condition allows you to join two tables (left 
@@ -142,41 +168,129 @@ static inline unsigned long row_size(schema_t *sc) {
 	return row_header_size() + row_data_size(sc);
 }
 
+void print_schema(schema_t *sc, std::string name);
+
+int create_table(data_base_t *db, std::string &name, schema_t *schema, table_t **new_table);
+void free_table(table_t *table); 
+int read_row(table_t *table, unsigned int row_num, row_t *row);
+int read_row_seq(table_t *table, unsigned int row_num, row_t *row);
+int write_row_dbg(table_t *table, row_t *row, unsigned int row_num);
+
+/* Is the row in one of the blocks pin_table() pinned */
+static inline int row_pinned(table_t *table, unsigned int row_num) {
+	return table->pinned_blocks && row_num / table->rows_per_blk < table->num_pinned; 
+}
+
+/* Point *row at a pinned row in place, *block is its block. Rows that 
+   aren't pinned are read into the buffer *row points to, *block is 
+   NULL and the caller writes them back with write_row_dbg() */
 static inline int get_pinned_row(table_t *table, unsigned int row_num, data_block_t **block,  row_t **row) {
 
 	unsigned long dblk_num;
 	unsigned long row_off; 
 	data_block_t *b;
 
-	/* Make a fake row if it's outside of the table
-           assuming it's padding */
-	//if(row_num >= table->num_rows) {
-	//	return -1; 
-	//} 
+	if (!row_pinned(table, row_num)) {
+		*block = NULL; 
+		return read_row(table, row_num, *row); 
+	}
 
 	dblk_num = row_num / table->rows_per_blk;
 
-	
 	/* Offset of the row within the data block in bytes */
 	row_off = (row_num - dblk_num * table->rows_per_blk) * row_size(table); 
-	//row_off = (row_num % table->rows_per_blk) * row_size(table); 
 
-        b = table->pinned_blocks[dblk_num]; 
+	b = table->pinned_blocks[dblk_num]; 
 	*block = b;  	
 	*row = (row_t*) ((char*)b->data + row_off); 
 	return 0; 
 }
 
-void print_schema(schema_t *sc, std::string name);
+/* A row accessed in place in its cached block. The handle holds a 
+   reference to the block until put_row_handle(), set dirty after 
+   changing the row and the block is marked dirty on release. Moving 
+   a handle to another row of the same block keeps the reference */
+typedef struct row_handle {
+	data_block_t *b;    /* Block of the row, NULL when not held */
+	row_t *row;         /* The row inside b->data */
+	int dirty;          /* Row was changed */
+	int pinned;         /* b is pinned by pin_table(), no reference of our own */
+} row_handle_t;
+
+static inline void init_row_handle(row_handle_t *h) {
+	h->b = NULL; 
+	h->row = NULL; 
+	h->dirty = 0; 
+	h->pinned = 0; 
+}
 
-int create_table(data_base_t *db, std::string &name, schema_t *schema, table_t **new_table);
-void free_table(table_t *table); 
-int read_row(table_t *table, unsigned int row_num, row_t *row);
-int write_row_dbg(table_t *table, row_t *row, unsigned int row_num);
+int get_row_handle(table_t *table, unsigned int row_num, row_handle_t *h);
+void put_row_handle(row_handle_t *h);
+
+/* Sequential read cursor over a table. It keeps the current block 
+   referenced, so of all the rows in a block only the first one goes 
+   through the buffer cache. Rows past the end read as fake rows, 
+   like read_row() */
+typedef struct table_cursor {
+	table_t *table; 
+	unsigned long row_num; /* Next row */
+	int hint;              /* BH_* hint for reading the blocks */
+	row_handle_t h; 
+} table_cursor_t; 
+
+void cursor_open(table_cursor_t *c, table_t *table, unsigned long row_num, int hint);
+int cursor_next(table_cursor_t *c, row_t *row);
+void cursor_close(table_cursor_t *c);
+
+/* Bulk appender for a table with no other writers. Rows are copied 
+   straight into the block being filled, a block that starts empty 
+   isn't read from disk. num_rows moves once per block, when the 
+   block is full or the appender is closed */
+typedef struct table_appender {
+	table_t *table; 
+	data_block_t *b;       /* Block being filled, NULL if none */
+	unsigned long row_num; /* Next row */
+} table_appender_t; 
+
+void appender_open(table_appender_t *a, table_t *table);
+int append_row(table_appender_t *a, row_t *row);
+void appender_close(table_appender_t *a);
 void print_row(schema_t *sc, row_t *row); 
 
 int read_data_block(table *table, unsigned long blk_num, void *buf);
+int read_data_blocks(table *table, unsigned long blk_num, void **bufs, int nblks);
 int write_data_block(table *table, unsigned long blk_num, void *buf); 
+int write_data_blocks(table *table, unsigned long blk_num, void **bufs, int nblks);
+
+/* A run of consecutive blocks of a table, bufs[i] holds block blk_num + i */
+typedef struct io_run {
+	struct table *table; 
+	unsigned long blk_num; 
+	void **bufs; 
+	int nblks; 
+} io_run_t; 
+
+int write_data_runs(io_run_t *runs, int nruns);
+
+#if defined(ASYNC_IO)
+/* A set of runs written behind the caller's back (write_batch_submit()), 
+   one batch per context is in flight at a time */
+#define IO_BATCH_BLKS IO_AIO_DEPTH
+
+typedef struct io_batch {
+	struct data_base *db;           /* of the staged runs */
+	void *buf;                      /* untrusted staging, IO_BATCH_BLKS blocks */
+	io_req_t reqs[IO_BATCH_BLKS]; 
+	int n;                          /* staged requests */
+	int inflight;                   /* submitted, not waited for yet */
+} io_batch_t; 
+
+int io_batch_init(io_batch_t *batch, unsigned long blk_size);
+void io_batch_free(io_batch_t *batch);
+int write_batch_stage(io_batch_t *batch, io_run_t *runs, int nruns);
+int write_batch_submit(io_batch_t *batch);
+int write_batch_wait(io_batch_t *batch);
+#endif
 
 int insert_row_dbg(table_t *table, row_t *row);
 
@@ -205,6 +319,7 @@ void *aligned_malloc(size_t size, size_t alignment);
 void aligned_free(void *aligned_ptr);
 int pin_table(table_t *table);
 int unpin_table_dirty(table_t *table);
+int unpin_table(table_t *table);
 int delete_table(data_base_t *db, table_t *table);
 data_base_t *get_db(unsigned int id);
 bool compare_rows(schema_t *sc, int column, row_t *row_l, row_t *row_r);
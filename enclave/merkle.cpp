@@ -0,0 +1,305 @@
+#include "merkle.hpp"
+#include "db.hpp"
+#include "util.hpp"
+
+#include "enclave_t.h"
+#include "sgx_trts.h"
+#include "sgx_tcrypto.h"
+
+#include <string.h>
+#include <cerrno>
+
+#if MERKLE_ARITY != 16
+#error "MERKLE_MAX_BLKS assumes MERKLE_ARITY is 16"
+#endif
+
+#define MERKLE_VERBOSE 0
+
+static void merkle_hash(merkle_t *m, const merkle_node_t *children, merkle_node_t *out)
+{
+	sgx_rijndael128_cmac_msg((const sgx_cmac_128bit_key_t *)m->key, 
+		(const uint8_t *)children, MERKLE_ARITY * sizeof(merkle_node_t), 
+		(sgx_cmac_128bit_tag_t *)out->h);
+	m->stats.hashes++; 
+}
+
+/* Blocks the tree covers at its current height */
+static inline unsigned long merkle_span(merkle_t *m)
+{
+	return 1UL << 4 * (m->levels - 1); 
+}
+
+/* Copy the group of siblings of node idx, the arrays hold whole 
+   groups so a group is either all there or all empty */
+static void merkle_read_group(merkle_t *m, int level, unsigned long idx, merkle_node_t *group)
+{
+	unsigned long first = idx & ~(MERKLE_ARITY - 1UL); 
+
+	if (first < m->nnodes[level]) {
+		memcpy(group, &m->nodes[level][first], MERKLE_ARITY * sizeof(merkle_node_t)); 
+		return; 
+	}
+	for (int i = 0; i < MERKLE_ARITY; i++)
+		group[i] = m->empty[level]; 
+}
+
+/* Make the untrusted array of level cover node idx. It at least 
+   doubles, new nodes are empty subtrees. */
+static int merkle_grow_level(merkle_t *m, int level, unsigned long idx)
+{
+	unsigned long n = m->nnodes[level], max = merkle_span(m) >> 4 * level; 
+	merkle_node_t *nodes = NULL; 
+
+	if (idx < n)
+		return 0; 
+
+	n = n * 2 > idx + 1 ? n * 2 : idx + 1; 
+	n = (n + MERKLE_ARITY - 1) & ~(MERKLE_ARITY - 1UL); 
+	if (n > max)
+		n = max; 
+
+	ocall_alloc_io_buf((void **)&nodes, n * sizeof(merkle_node_t)); 
+	if (!nodes || !sgx_is_outside_enclave(nodes, n * sizeof(merkle_node_t)))
+		return -ENOMEM; 
+
+	if (m->nodes[level]) {
+		memcpy(nodes, m->nodes[level], m->nnodes[level] * sizeof(merkle_node_t)); 
+		ocall_free_io_buf(m->nodes[level]); 
+	}
+	for (unsigned long i = m->nnodes[level]; i < n; i++)
+		nodes[i] = m->empty[level]; 
+
+	m->nodes[level] = nodes; 
+	m->nnodes[level] = n; 
+	return 0; 
+}
+
+/* Put a level on top of the tree, the old root becomes the first 
+   node of a new interior level */
+static int merkle_grow_height(merkle_t *m)
+{
+	merkle_node_t group[MERKLE_ARITY]; 
+	int level = m->levels - 1; 
+
+	if (m->levels == MERKLE_MAX_LEVELS)
+		return -1; 
+
+	m->levels++; 
+	if (merkle_grow_level(m, level, 0)) {
+		m->levels--; 
+		return -ENOMEM; 
+	}
+	m->nodes[level][0] = m->root; 
+
+	group[0] = m->root; 
+	for (int i = 1; i < MERKLE_ARITY; i++)
+		group[i] = m->empty[level]; 
+	merkle_hash(m, group, &m->root); 
+	return 0; 
+}
+
+static inline merkle_cache_entry_t *merkle_cache_slot(merkle_t *m, int level, unsigned long idx)
+{
+	unsigned long key = ((unsigned long)level << 32) | idx; 
+	return &m->cache[(key * 0x9E3779B97F4A7C15UL >> 32) & (MERKLE_CACHE_NODES - 1)]; 
+}
+
+static int merkle_cache_lookup(merkle_t *m, int level, unsigned long idx, merkle_node_t *node)
+{
+	merkle_cache_entry_t *e = merkle_cache_slot(m, level, idx); 
+
+	if (e->key != (((unsigned long)level << 32) | idx))
+		return 0; 
+	*node = e->node; 
+	return 1; 
+}
+
+static void merkle_cache_insert(merkle_t *m, int level, unsigned long idx, merkle_node_t *node)
+{
+	merkle_cache_entry_t *e = merkle_cache_slot(m, level, idx); 
+
+	e->key = ((unsigned long)level << 32) | idx; 
+	e->node = *node; 
+}
+
+/* Check leaf idx with value leaf against the tree. The sibling groups 
+   are copied into groups before they are hashed, so the host can't 
+   change them under us. Stops at the first cached ancestor if 
+   use_cache is set, at the root otherwise. Returns the number of 
+   levels walked or -1 if the path doesn't match. */
+static int merkle_check_path(merkle_t *m, unsigned long idx, const merkle_node_t *leaf, 
+			     merkle_node_t groups[][MERKLE_ARITY], merkle_node_t *path, int use_cache)
+{
+	merkle_node_t cur = *leaf, trusted; 
+	int level; 
+
+	for (level = 0; level < m->levels - 1; level++) {
+		merkle_read_group(m, level, idx, groups[level]); 
+		groups[level][idx % MERKLE_ARITY] = cur; 
+
+		merkle_hash(m, groups[level], &path[level + 1]); 
+		cur = path[level + 1]; 
+		idx /= MERKLE_ARITY; 
+
+		if (level + 1 == m->levels - 1)
+			return memcmp(&cur, &m->root, sizeof(cur)) ? -1 : level + 1; 
+
+		if (use_cache && merkle_cache_lookup(m, level + 1, idx, &trusted)) {
+			m->stats.cache_hits++; 
+			return memcmp(&cur, &trusted, sizeof(cur)) ? -1 : level + 1; 
+		}
+	}
+	return -1; 
+}
+
+/* Set up the tree of an empty table, all leaves are zero (never 
+   written blocks). Nothing is in untrusted memory until a block is 
+   written. */
+int merkle_init(struct table *table)
+{
+	merkle_node_t group[MERKLE_ARITY]; 
+	merkle_t *m; 
+
+	m = new merkle_t(); 
+	if (!m)
+		return -ENOMEM; 
+
+	initlock(&m->lock, "merkle"); 
+
+	if (sgx_read_rand(m->key, sizeof(m->key)) != SGX_SUCCESS) {
+		ERR("failed to generate merkle key for table %s\n", table->name.c_str()); 
+		delete m; 
+		return -1; 
+	}
+
+	memset(&m->empty[0], 0, sizeof(m->empty[0])); 
+	for (int level = 1; level < MERKLE_MAX_LEVELS; level++) {
+		for (int i = 0; i < MERKLE_ARITY; i++)
+			group[i] = m->empty[level - 1]; 
+		merkle_hash(m, group, &m->empty[level]); 
+	}
+	m->levels = 2; 
+	m->root = m->empty[1]; 
+	memset(&m->stats, 0, sizeof(m->stats)); 
+
+	table->merkle = m; 
+	return 0; 
+}
+
+void merkle_free(struct table *table)
+{
+	if (!table->merkle)
+		return; 
+
+	for (int level = 0; level < MERKLE_MAX_LEVELS - 1; level++)
+		if (table->merkle->nodes[level])
+			ocall_free_io_buf(table->merkle->nodes[level]); 
+	delete table->merkle; 
+	table->merkle = NULL; 
+}
+
+/* Check that mac is the latest MAC written for the block */
+int merkle_verify(struct table *table, unsigned long blk_num, const unsigned char *mac)
+{
+	merkle_node_t groups[MERKLE_MAX_LEVELS - 1][MERKLE_ARITY], path[MERKLE_MAX_LEVELS]; 
+	merkle_t *m = table->merkle; 
+	int ret; 
+
+	acquire(&m->lock); 
+
+	m->stats.verifies++; 
+	memcpy(path[0].h, mac, MERKLE_HASH_SIZE); 
+
+	/* Nothing was written past the tree */
+	if (blk_num >= merkle_span(m)) {
+		ret = memcmp(&path[0], &m->empty[0], sizeof(path[0])); 
+		release(&m->lock); 
+		if (ret) {
+			ERR("block %lu of %s is past the merkle tree\n", blk_num, table->name.c_str()); 
+			return -1; 
+		}
+		return 0; 
+	}
+
+	ret = merkle_check_path(m, blk_num, &path[0], groups, path, 1); 
+	if (ret < 0) {
+		release(&m->lock); 
+		ERR("block %lu of %s is stale or was tampered with\n", blk_num, table->name.c_str()); 
+		return -1; 
+	}
+
+	/* The ancestors below the trusted one are verified now */
+	for (int level = 1; level < ret && level < m->levels - 1; level++)
+		merkle_cache_insert(m, level, blk_num >> (4 * level), &path[level]); 
+
+	release(&m->lock); 
+
+	DBG_ON(MERKLE_VERBOSE, "verified block %lu of %s, %d levels\n", 
+		blk_num, table->name.c_str(), ret); 
+	return 0; 
+}
+
+/* Record mac as the new MAC of the block. The old path is checked all 
+   the way to the root first, its siblings go into the new root */
+int merkle_update(struct table *table, unsigned long blk_num, const unsigned char *mac)
+{
+	merkle_node_t groups[MERKLE_MAX_LEVELS - 1][MERKLE_ARITY], path[MERKLE_MAX_LEVELS], cur; 
+	merkle_t *m = table->merkle; 
+	unsigned long idx = blk_num; 
+
+	if (blk_num >= MERKLE_MAX_BLKS) {
+		ERR("block %lu of %s is past the merkle tree\n", blk_num, table->name.c_str()); 
+		return -1; 
+	}
+
+	acquire(&m->lock); 
+
+	while (blk_num >= merkle_span(m)) {
+		if (merkle_grow_height(m)) {
+			release(&m->lock); 
+			ERR("failed to grow merkle tree of %s\n", table->name.c_str()); 
+			return -1; 
+		}
+	}
+	for (int level = 0; level < m->levels - 1; level++) {
+		if (merkle_grow_level(m, level, blk_num >> 4 * level)) {
+			release(&m->lock); 
+			ERR("failed to grow merkle tree of %s\n", table->name.c_str()); 
+			return -1; 
+		}
+	}
+
+	m->stats.updates++; 
+	path[0] = m->nodes[0][blk_num]; 
+
+	if (merkle_check_path(m, blk_num, &path[0], groups, path, 0) < 0) {
+		release(&m->lock); 
+		ERR("merkle tree of %s was tampered with\n", table->name.c_str()); 
+		return -1; 
+	}
+
+	memcpy(cur.h, mac, MERKLE_HASH_SIZE); 
+	for (int level = 0; level < m->levels - 1; level++) {
+		m->nodes[level][idx] = cur; 
+		if (level)
+			merkle_cache_insert(m, level, idx, &cur); 
+
+		groups[level][idx % MERKLE_ARITY] = cur; 
+		merkle_hash(m, groups[level], &cur); 
+		idx /= MERKLE_ARITY; 
+	}
+	m->root = cur; 
+
+	release(&m->lock); 
+	return 0; 
+}
+
+void merkle_stats_read_and_reset(struct table *table, merkle_stats_t *stats)
+{
+	merkle_t *m = table->merkle; 
+
+	acquire(&m->lock); 
+	*stats = m->stats; 
+	memset(&m->stats, 0, sizeof(m->stats)); 
+	release(&m->lock); 
+}
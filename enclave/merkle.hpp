@@ -0,0 +1,60 @@
+#pragma once
+
+#include "spinlock.hpp"
+
+/* Freshness of a table's blocks on disk. A Merkle tree over the block 
+   MACs keeps the host from rolling a block back to an older sealed 
+   version. Only the root lives in the enclave, the rest of the tree 
+   sits in untrusted memory and every node read from there is checked 
+   against a trusted ancestor. Interior nodes that were verified are 
+   kept in a small enclave cache, so a read miss only hashes the path 
+   up to the first cached node. */
+
+#define MERKLE_ARITY 16
+#define MERKLE_MAX_LEVELS 8 /* leaves (block MACs), up to 6 interior levels, root */
+#define MERKLE_MAX_BLKS (1UL << 4 * (MERKLE_MAX_LEVELS - 1)) /* MERKLE_ARITY ^ (MERKLE_MAX_LEVELS - 1) */
+#define MERKLE_HASH_SIZE 16
+
+/* Verified interior nodes cached per table, must be a power of two */
+#define MERKLE_CACHE_NODES 512
+
+typedef struct merkle_node {
+	unsigned char h[MERKLE_HASH_SIZE];
+} merkle_node_t;
+
+typedef struct merkle_cache_entry {
+	unsigned long key; /* level << 32 | index, 0 if empty */
+	merkle_node_t node;
+} merkle_cache_entry_t;
+
+typedef struct merkle_stats {
+	unsigned long verifies;
+	unsigned long updates;
+	unsigned long hashes; /* interior nodes computed */
+	unsigned long cache_hits;
+} merkle_stats_t;
+
+/* The tree grows with the table. It starts with a root over one 
+   group of leaves and gets another level on top whenever a block past 
+   the ones it covers is written. Below the root each level is an 
+   untrusted array that only reaches as far as the blocks written, 
+   nodes past its end are roots of empty subtrees */
+typedef struct merkle {
+	struct spinlock lock;
+	unsigned char key[MERKLE_HASH_SIZE]; /* CMAC key of interior nodes */
+	merkle_node_t root;
+	int levels; /* levels including the leaves and the root */
+	merkle_node_t *nodes[MERKLE_MAX_LEVELS - 1]; /* untrusted */
+	unsigned long nnodes[MERKLE_MAX_LEVELS - 1]; /* nodes in each array */
+	merkle_node_t empty[MERKLE_MAX_LEVELS]; /* root of an empty subtree per level */
+	merkle_cache_entry_t cache[MERKLE_CACHE_NODES];
+	merkle_stats_t stats;
+} merkle_t;
+
+struct table;
+
+int merkle_init(struct table *table);
+void merkle_free(struct table *table);
+int merkle_verify(struct table *table, unsigned long blk_num, const unsigned char *mac);
+int merkle_update(struct table *table, unsigned long blk_num, const unsigned char *mac);
+void merkle_stats_read_and_reset(struct table *table, merkle_stats_t *stats);
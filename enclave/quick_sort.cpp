@@ -36,26 +36,6 @@ int ecall_quicksort_table(int db_id, int table_id, int field, int *sorted_id) {
 	return ret; 
 }
 
-int quicksort_table_parallel(table_t *table, int column, int tid, int num_threads) {
-	int ret = 0; 
-
-	/*
-	if (!(db = get_db(db_id)))
-		return -1;
-
-	if ((table_id > (MAX_TABLES - 1)) || !db->tables[table_id])
-		return -2; 
-
-	table = db->tables[table_id];
-
-	ret = quick_sort_table_parallel(db, table, field, &s_table); 
-
-#ifdef CREATE_SORTED_TABLE
-	*sorted_id = s_table->id; 
-#endif*/
-	return ret;
-}
-
 int ecall_quicksort_table_parallel(int db_id, int table_id, int column, int tid, int num_threads)
 {
 	data_base_t *db;
@@ -74,55 +54,23 @@ int ecall_quicksort_table_parallel(int db_id, int table_id, int column, int tid,
 	return quicksort_table_parallel(table, column, tid, num_threads);
 };
 
-row_t *row = NULL, *start_row = NULL, *end_row = NULL, *temp_row = NULL;
-
-int allocate_memory_for_quicksort(table_t *tbl) {
-
-	row = (row_t *) malloc(row_size(tbl));
-	if(!row)
-		goto fail1;
-
-	start_row = (row_t *) malloc(row_size(tbl));
-	if(!start_row)
-		goto fail2;
-	
-	end_row = (row_t *) malloc(row_size(tbl));
-	if(!end_row)
-		goto fail3;
-
-	temp_row = (row_t *) malloc(row_size(tbl));
-	if(!temp_row)
-		goto fail4;
-
+int qsort_ctx_init(qsort_ctx_t *ctx, table_t *table, int column) {
+	ctx->table = table; 
+	ctx->column = column; 
+	ctx->pivot = (row_t *) malloc(row_size(table));
+	if (!ctx->pivot)
+		return -ENOMEM;
 	return 0;
-
-fail4:
-	free(end_row);
-fail3:
-	free(start_row);
-fail2:
-	free(row);
-fail1:
-	return -ENOMEM;
 }
 
-void deallocate_memory_for_quicksort() {
-	if (row)
-		free(row); 
-	
-	if (start_row)
-		free(start_row); 
-
-	if (end_row)
-		free(end_row);
-
-	if (temp_row)
-		free(temp_row);
+void qsort_ctx_free(qsort_ctx_t *ctx) {
+	free(ctx->pivot); 
+	ctx->pivot = NULL; 
 }
 
-
 int quick_sort_table(data_base_t *db, table_t *tbl, int column, table_t **p_tbl)
 {
+	qsort_ctx_t ctx; 
 	int ret = 0;
 
 #if defined(REPORT_QSORT_STATS)
@@ -147,7 +95,7 @@ int quick_sort_table(data_base_t *db, table_t *tbl, int column, table_t **p_tbl)
             s_tbl_name.c_str(), s_tbl->id); 
 #endif
 	
-	ret = allocate_memory_for_quicksort(tbl);
+	ret = qsort_ctx_init(&ctx, tbl, column);
 	if (ret) {
 		ERR("memory allocation failed: %d\n", ret);
 		return ret;
@@ -157,81 +105,18 @@ int quick_sort_table(data_base_t *db, table_t *tbl, int column, table_t **p_tbl)
 	start = RDTSC();
 #endif
 	// index runs from 0 to (num_rows - 1)
-	quickSort(tbl, column, 0, tbl->num_rows - 1);
-
-#if defined(REPORT_QSORT_STATS)
-	end = RDTSC();
-	cycles = end - start;
-	secs = (cycles / cycles_per_sec);
-
-	INFO(" In-place quicksort took %llu cycles (%f sec)\n", cycles, secs);
-#endif
-
-#ifdef CREATE_SORTED_TABLE
-	bflush(*p_tbl);
-#endif
-	//print_table_dbg(tbl, 0, tbl->num_rows);
-
-	ret = verify_sorted_output(tbl, 0, tbl->num_rows, column);
-
-	INFO(" %s, verify_sorted_output returned %d\n", __func__, ret);
-
-	if (ret) {
-		ERR("============================\n");
-		ERR("%s: SORTED OUTPUT INCORRECT \n");
-		ERR("============================\n");
-	}
-	deallocate_memory_for_quicksort();
-	return ret; 	
-}
-
-int quick_sort_table_parallel(data_base_t *db, table_t *tbl, int column, table_t **p_tbl)
-{
-	int ret = 0;
-
-#if defined(REPORT_QSORT_STATS)
-	unsigned long long start, end;
-	unsigned long long cycles;
-	double secs;
-#endif
-
-#ifdef CREATE_SORTED_TABLE
-	std::string s_tbl_name;  
-	schema_t p_sc;
-
-	s_tbl_name = "s:" + tbl->name; 
-
-	ret = create_table(db, s_tbl_name, &p_sc, p_tbl);
-	if (ret) {
-		ERR("create table:%d\n", ret);
-		return ret; 
-	}
-
-	DBG("Created sorted table %s, id:%d\n", 
-            s_tbl_name.c_str(), s_tbl->id); 
-#endif
-
-	ret = allocate_memory_for_quicksort(tbl);
+	ret = quickSort(&ctx, 0, tbl->num_rows - 1);
 	if (ret) {
-		ERR("memory allocation failed: %d\n", ret);
+		qsort_ctx_free(&ctx);
 		return ret;
 	}
 
-#if defined(REPORT_QSORT_STATS)
-	start = RDTSC();
-#endif
-	// index runs from 0 to (num_rows - 1)
-//#pragma omp parallel
-//#pragma omp single
-	quickSort_parallel(tbl, column, 0, tbl->num_rows - 1);
-	//#pragma omp taskwait
-
 #if defined(REPORT_QSORT_STATS)
 	end = RDTSC();
 	cycles = end - start;
 	secs = (cycles / cycles_per_sec);
 
-	INFO("In-place quicksort took %llu cycles (%f sec)\n", cycles, secs);
+	INFO(" In-place quicksort took %llu cycles (%f sec)\n", cycles, secs);
 #endif
 
 #ifdef CREATE_SORTED_TABLE
@@ -241,20 +126,18 @@ int quick_sort_table_parallel(data_base_t *db, table_t *tbl, int column, table_t
 
 	ret = verify_sorted_output(tbl, 0, tbl->num_rows, column);
 
-#if defined(REPORT_QSORT_STATS)
-	INFO("%s, verify_sorted_output returned %d\n", __func__, ret);
-#endif
+	INFO(" %s, verify_sorted_output returned %d\n", __func__, ret);
 
 	if (ret) {
 		ERR("============================\n");
 		ERR("%s: SORTED OUTPUT INCORRECT \n");
 		ERR("============================\n");
 	}
-	deallocate_memory_for_quicksort();
+	qsort_ctx_free(&ctx);
 	return ret; 	
 }
- 
-void quickSort(table_t *tbl, int column, int start, int end) {
+
+int quickSort(qsort_ctx_t *ctx, int start, int end) {
 
 #if defined(REPORT_QSORT_STATS)
 	unsigned long long start_sec, end_sec;
@@ -263,16 +146,16 @@ void quickSort(table_t *tbl, int column, int start, int end) {
 #endif
 
 	if (start >= end) {
-		return;
+		return 0;
 	}
 
 #if defined(REPORT_QSORT_STATS)
 	start_sec = RDTSC();
 #endif	
-	int pivot = partition(tbl, column, start, end);
+	int pivot = partition(ctx, start, end);
 	if (pivot == -1) {
 		ERR("Sorting failed\n");
-		return;
+		return -1;
 	}
 #if defined(REPORT_QSORT_STATS)
 	end_sec = RDTSC();
@@ -285,7 +168,8 @@ void quickSort(table_t *tbl, int column, int start, int end) {
 #if defined(REPORT_QSORT_STATS)
 	start_sec = RDTSC();
 #endif
-	quickSort(tbl, column, start, pivot);
+	if (quickSort(ctx, start, pivot))
+		return -1;
 #if defined(REPORT_QSORT_STATS)
 	end_sec = RDTSC();
 	cycles = end_sec - start_sec;
@@ -297,7 +181,8 @@ void quickSort(table_t *tbl, int column, int start, int end) {
 #if defined(REPORT_QSORT_STATS)
 	start_sec = RDTSC();
 #endif
-	quickSort(tbl, column, pivot + 1, end);
+	if (quickSort(ctx, pivot + 1, end))
+		return -1;
 #if defined(REPORT_QSORT_STATS)
 	end_sec = RDTSC();
 	cycles = end_sec - start_sec;
@@ -305,43 +190,218 @@ void quickSort(table_t *tbl, int column, int start, int end) {
 
 	INFO(" #2 quickSort from %d to %d took %llu cycles (%f sec)\n", pivot+1, end, cycles, secs);
 #endif
+	return 0;
 }
 
-void quickSort_parallel(table_t *tbl, int column, int start, int end) {
+/* Parallel quicksort. Ranges still to be sorted sit on a shared stack, 
+   a thread pops one, partitions it, pushes one half back and goes on 
+   with the other until the range is small enough to sort by itself */
+#define QSORT_MAX_RANGES 1024
+#define QSORT_SEQ_ROWS 2048   /* Ranges this small are sorted by one thread */
 
-	if (start >= end) {
-		return;
+int qsort_shared_init(table_t *table) {
+	qsort_shared_t *qs; 
+
+	qs = new qsort_shared_t(); 
+	if (!qs)
+		return -ENOMEM; 
+
+	initlock(&qs->lock, "qsort"); 
+	barrier_init(&qs->barrier); 
+	table->qsort = qs; 
+	return 0; 
+}
+
+void qsort_shared_free(table_t *table) {
+	delete table->qsort; 
+	table->qsort = NULL; 
+}
+
+/* 0 if the stack is full, the caller sorts the range itself */
+static int qsort_push(qsort_shared_t *qs, int start, int end) {
+	int pushed = 0; 
+
+	acquire(&qs->lock); 
+	if (qs->nranges < QSORT_MAX_RANGES) {
+		qs->ranges[qs->nranges].start = start; 
+		qs->ranges[qs->nranges].end = end; 
+		qs->nranges++; 
+		pushed = 1; 
 	}
-	
-	int pivot = partition(tbl, column, start, end);
-	if (pivot == -1) {
-		ERR("Sorting failed\n");
-		return;
+	release(&qs->lock); 
+	return pushed; 
+}
+
+/* Wait for a range to sort, 0 once there is nothing left. A range 
+   being partitioned can still push more, so the stack running empty 
+   isn't the end until no thread is busy */
+static int qsort_pop(qsort_shared_t *qs, qsort_range_t *range) {
+	while (true) {
+		acquire(&qs->lock); 
+		if (qs->nranges && !qs->failed) {
+			*range = qs->ranges[--qs->nranges]; 
+			qs->busy++; 
+			release(&qs->lock); 
+			return 1; 
+		}
+
+		if (!qs->busy || qs->failed) {
+			release(&qs->lock); 
+			return 0; 
+		}
+		release(&qs->lock); 
+
+		while (!qs->nranges && qs->busy && !qs->failed)
+			_mm_pause();
 	}
-	
-	//omp_set_nested(1);
-	//#pragma omp parallel sections num_threads(16)
-	{
-		//#pragma omp task
-		//#pragma omp section	
-		quickSort(tbl, column, start, pivot);
-		//#pragma omp task
-		//#pragma omp section
-		quickSort(tbl, column, pivot + 1, end);
+}
+
+static void qsort_done(qsort_shared_t *qs) {
+	acquire(&qs->lock); 
+	qs->busy--; 
+	release(&qs->lock); 
+}
+
+/* All num_threads threads call this to sort table in place */
+int quicksort_table_parallel(table_t *table, int column, int tid, int num_threads) {
+	qsort_shared_t *qs = table->qsort; 
+	/* The barrier only flips when every thread is in, so its sense 
+	   now is where this sort starts */
+	volatile unsigned int lsense = qs->barrier.global_sense; 
+	qsort_ctx_t ctx; 
+	qsort_range_t range; 
+	int start, end, pivot; 
+	int ret; 
+
+#if defined(REPORT_QSORT_STATS)
+	unsigned long long start_sec, end_sec;
+	unsigned long long cycles;
+	double secs;
+#endif
+
+	if (tid == 0) {
+		qs->nranges = 0; 
+		qs->busy = 0; 
+		qs->failed = 0; 
+		qs->ranges = (qsort_range_t *)malloc(QSORT_MAX_RANGES * sizeof(qsort_range_t)); 
+		if (!qs->ranges) {
+			ERR("memory allocation failed\n");
+			qs->failed = 1; 
+		} else if (table->num_rows > 1) {
+			qsort_push(qs, 0, table->num_rows - 1); 
+		}
+	}
+
+	/* A thread without a context leaves the work to the others */
+	ret = qsort_ctx_init(&ctx, table, column);
+	if (ret)
+		ERR("memory allocation failed: %d\n", ret);
+
+	barrier_wait(&qs->barrier, &lsense, tid, num_threads);
+
+#if defined(REPORT_QSORT_STATS)
+	start_sec = RDTSC();
+#endif
+
+	while (!ret && qsort_pop(qs, &range)) {
+		start = range.start; 
+		end = range.end; 
+
+		while (end - start + 1 > QSORT_SEQ_ROWS) {
+			pivot = partition(&ctx, start, end);
+			if (pivot == -1) {
+				ERR("Sorting failed\n");
+				qs->failed = 1; 
+				break; 
+			}
+
+			/* Give away the smaller half, keep the bigger one */
+			if (pivot - start < end - pivot) {
+				if (!qsort_push(qs, start, pivot))
+					break; 
+				start = pivot + 1; 
+			} else {
+				if (!qsort_push(qs, pivot + 1, end))
+					break; 
+				end = pivot; 
+			}
+		}
+
+		if (!qs->failed && quickSort(&ctx, start, end))
+			qs->failed = 1; 
+		qsort_done(qs); 
 	}
+
+	if (!ret) {
+		qsort_ctx_free(&ctx);
+		/* Out of the loop nothing is busy, this is final */
+		ret = qs->failed ? -1 : 0; 
+	}
+
+	barrier_wait(&qs->barrier, &lsense, tid, num_threads);
+
+	if (tid == 0) {
+		free(qs->ranges); 
+		qs->ranges = NULL; 
+	}
+
+	if (ret)
+		return ret; 
+
+	if (tid == 0) {
+#if defined(REPORT_QSORT_STATS)
+		end_sec = RDTSC();
+		cycles = end_sec - start_sec;
+		secs = (cycles / cycles_per_sec);
+
+		INFO(" Parallel quicksort with %d threads took %llu cycles (%f sec)\n", 
+			num_threads, cycles, secs);
+#endif
+		ret = verify_sorted_output(table, 0, table->num_rows, column);
+		if (ret) {
+			ERR("============================\n");
+			ERR("%s: SORTED OUTPUT INCORRECT \n", __func__);
+			ERR("============================\n");
+		}
+	}
+	return ret; 
 }
 
+// Column of row row_num in place, h keeps a reference to its block
+static inline void *handle_element(table_t *tbl, int row_num, row_handle_t *h, int column) {
+	if (get_row_handle(tbl, row_num, h))
+		return NULL;
+	return get_column(&tbl->sc, column, h->row);
+}
 
+/* Rows are ordered by the column, with fake rows (column sort pads 
+   its tables with them) after all real ones. Is the row h holds below 
+   or above the pivot, lt and gt compare its column with the pivot's */
+#define QSORT_BELOW(h, lt) (!(h)->row->header.fake && (pivot_fake || (lt)))
+#define QSORT_ABOVE(h, gt) (!pivot_fake && ((h)->row->header.fake || (gt)))
 
-int partition(table_t *tbl, int column, int start, int end) {
+int partition(qsort_ctx_t *ctx, int start, int end) {
+
+	table_t *tbl = ctx->table; 
+	int column = ctx->column; 
 
 	int mid = start + (end - start) / 2;
 	int i = start - 1;
 	int j = end + 1;
-	void *pivot_data = get_element(tbl, mid, row, column);
+	row_handle_t hi, hj;
+	void *pivot_data, *elem;
+	bool pivot_fake;
+
+	// Rows are compared and swapped in place, the pivot row moves 
+	// with the swaps so keep a copy of it
+	init_row_handle(&hi);
+	init_row_handle(&hj);
 
-	if (!pivot_data)
+	if (get_row_handle(tbl, mid, &hi))
 		return -1;
+	memcpy(ctx->pivot, hi.row, row_size(tbl));
+	pivot_data = get_column(&tbl->sc, column, ctx->pivot);
+	pivot_fake = ctx->pivot->header.fake;
 
 	while (true) {
 		switch (tbl->sc.types[column]) {
@@ -351,14 +411,20 @@ int partition(table_t *tbl, int column, int start, int end) {
 
 				do {
 					i++;
-				} while ((start_val = *((bool*)get_element(tbl, i, start_row, column))) < pivot);
+					if (!(elem = handle_element(tbl, i, &hi, column)))
+						goto fail;
+					start_val = *((bool*)elem);
+				} while (QSORT_BELOW(&hi, start_val < pivot));
 
 				do {
 					j--;
-				} while ((end_val = *((bool*)get_element(tbl, j, end_row, column))) > pivot);
+					if (!(elem = handle_element(tbl, j, &hj, column)))
+						goto fail;
+					end_val = *((bool*)elem);
+				} while (QSORT_ABOVE(&hj, end_val > pivot));
 
 				if (i >= j)
-					return j;
+					goto done;
 
 				break;
 			}
@@ -368,14 +434,20 @@ int partition(table_t *tbl, int column, int start, int end) {
 
 				do {
 					i++;
-				} while ((start_val = *((int*)get_element(tbl, i, start_row, column))) < pivot);
+					if (!(elem = handle_element(tbl, i, &hi, column)))
+						goto fail;
+					start_val = *((int*)elem);
+				} while (QSORT_BELOW(&hi, start_val < pivot));
 
 				do {
 					j--;
-				} while ((end_val = *((int*)get_element(tbl, j, end_row, column))) > pivot);
+					if (!(elem = handle_element(tbl, j, &hj, column)))
+						goto fail;
+					end_val = *((int*)elem);
+				} while (QSORT_ABOVE(&hj, end_val > pivot));
 
 				if (i >= j)
-					return j;
+					goto done;
 
 				break;
 
@@ -387,25 +459,38 @@ int partition(table_t *tbl, int column, int start, int end) {
 
 				do {
 					i++;
-					start_val = (char*)get_element(tbl, i, start_row, column);
-				} while (strncmp(start_val, pivot, MAX_ROW_SIZE) < 0);
+					if (!(elem = handle_element(tbl, i, &hi, column)))
+						goto fail;
+					start_val = (char*)elem;
+				} while (QSORT_BELOW(&hi, strncmp(start_val, pivot, MAX_ROW_SIZE) < 0));
 
 				do {
 					j--;
-					end_val = (char*)get_element(tbl, j, end_row, column);
-				} while (strncmp(end_val, pivot, MAX_ROW_SIZE) > 0);
+					if (!(elem = handle_element(tbl, j, &hj, column)))
+						goto fail;
+					end_val = (char*)elem;
+				} while (QSORT_ABOVE(&hj, strncmp(end_val, pivot, MAX_ROW_SIZE) > 0));
 
 				if (i >= j)
-					return j;
+					goto done;
 
 				break;
 			}
 			default:
-				break;
+				ERR("can't sort on column type %d\n", tbl->sc.types[column]);
+				j = -1;
+				goto done;
 		}
 
-		// Perform swap by writing start_row to jth position and
-		// end_row to ith position
-		exchange(tbl, i, j, start_row, end_row, 0);
+		// Swap rows i and j
+		swap_rows(tbl, &hi, &hj);
 	}
+
+fail:
+	ERR("failed to read rows %d-%d of %s\n", start, end, tbl->name.c_str());
+	j = -1;
+done:
+	put_row_handle(&hi);
+	put_row_handle(&hj);
+	return j;
 }
@@ -1,10 +1,40 @@
 #ifndef _QUICK_SORT_HPP
 #define _QUICK_SORT_HPP
 
+/* State of one quicksort. Each sort, or each thread of a parallel 
+   sort, has its own, so any number of them can run at once */
+typedef struct qsort_ctx {
+	table_t *table; 
+	int column;      /* Sort key */
+	row_t *pivot;    /* Copy of the row being partitioned around */
+} qsort_ctx_t; 
+
+int qsort_ctx_init(qsort_ctx_t *ctx, table_t *table, int column);
+void qsort_ctx_free(qsort_ctx_t *ctx);
+
+typedef struct qsort_range {
+	int start; 
+	int end; 
+} qsort_range_t; 
+
+/* State the threads of a parallel quicksort share. Each table has 
+   one, so sorts of different tables can run at once */
+typedef struct qsort_shared {
+	struct spinlock lock; 
+	qsort_range_t *ranges;  /* Ranges still to be sorted, for one sort */
+	volatile int nranges; 
+	volatile int busy;      /* Threads working on a popped range */
+	volatile int failed; 
+	barrier_t barrier; 
+} qsort_shared_t; 
+
+int qsort_shared_init(table_t *table);
+void qsort_shared_free(table_t *table);
+
 int quick_sort_table(data_base_t *db, table_t *tbl, int column, table_t **p_tbl);
-void quickSort(table_t *tbl, int column, int start, int end);
-int partition(table_t *tbl, int column, int start, int end);
+int quickSort(qsort_ctx_t *ctx, int start, int end);
+int partition(qsort_ctx_t *ctx, int start, int end);
 
-void quickSort_parallel(table_t *tbl, int column, int start, int end);
+int quicksort_table_parallel(table_t *table, int column, int tid, int num_threads);
 
 #endif // _QUICK_SORT_HPP
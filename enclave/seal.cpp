@@ -0,0 +1,182 @@
+#include "seal.hpp"
+#include "db.hpp"
+#include "util.hpp"
+
+#include "enclave_t.h"
+#include "sgx_trts.h"
+#include "sgx_tcrypto.h"
+
+#include <string.h>
+#include <cerrno>
+
+#if defined(SEAL_BLOCKS) && BLOCK_SEAL_SIZE != 32
+#error "BLOCK_SEAL_SIZE must match block_seal_t"
+#endif
+
+#if defined(BLOCK_FRESHNESS) && !defined(SEAL_BLOCKS)
+#error "BLOCK_FRESHNESS needs SEAL_BLOCKS"
+#endif
+
+#define SEAL_VERBOSE 0
+
+/* Pick a fresh key for a new table. Write sequence numbers start 
+   at 1, an all zero seal marks a block that was never written */
+int seal_init(struct table *table)
+{
+	table->seal_seq = 1; 
+	initlock(&table->seal_written.lock, "seal_written"); 
+	table->seal_written.bits = NULL; 
+	table->seal_written.nblks = 0; 
+
+	if (sgx_read_rand(table->seal_key, SEAL_KEY_SIZE) != SGX_SUCCESS) {
+		ERR("failed to generate key for table %s\n", table->name.c_str()); 
+		return -1; 
+	}
+	return 0; 
+}
+
+void seal_free(struct table *table)
+{
+	free(table->seal_written.bits); 
+	table->seal_written.bits = NULL; 
+	table->seal_written.nblks = 0; 
+}
+
+/* Record blocks [blk_num, blk_num + nblks) as sealed */
+static int seal_mark_written(struct table *table, unsigned long blk_num, int nblks)
+{
+	seal_written_t *w = &table->seal_written; 
+	unsigned long n; 
+	unsigned char *bits; 
+
+	acquire(&w->lock); 
+
+	if (blk_num + nblks > w->nblks) {
+		n = w->nblks ? w->nblks : 1024; 
+		while (n < blk_num + nblks)
+			n *= 2; 
+
+		bits = (unsigned char *)realloc(w->bits, n / 8); 
+		if (!bits) {
+			release(&w->lock); 
+			ERR("failed to grow written map of %s\n", table->name.c_str()); 
+			return -ENOMEM; 
+		}
+		memset(bits + w->nblks / 8, 0, (n - w->nblks) / 8); 
+		w->bits = bits; 
+		w->nblks = n; 
+	}
+
+	for (unsigned long bn = blk_num; bn < blk_num + nblks; bn++)
+		w->bits[bn / 8] |= 1 << (bn % 8); 
+
+	release(&w->lock); 
+	return 0; 
+}
+
+static int seal_was_written(struct table *table, unsigned long blk_num)
+{
+	seal_written_t *w = &table->seal_written; 
+	int ret; 
+
+	acquire(&w->lock); 
+	ret = blk_num < w->nblks && (w->bits[blk_num / 8] & (1 << (blk_num % 8))); 
+	release(&w->lock); 
+	return ret; 
+}
+
+/* Encrypt nblks blocks, bufs[i] holds block blk_num + i, into the 
+   consecutive staging buffer dst. Blocks are sealed one by one, each 
+   with its own nonce and MAC, and written straight into the staging 
+   buffer, so there is no separate copy out of the enclave */
+int seal_blocks(struct table *table, unsigned long blk_num, void **bufs, void *dst, int nblks)
+{
+	unsigned long bs = table->db->bcache.blk_size; 
+	block_seal_t seal; 
+	unsigned long seq, bn; 
+	sgx_status_t ret; 
+
+	memset(seal.pad, 0, sizeof(seal.pad)); 
+
+	/* From now on the blocks can't be read back as holes */
+	if (seal_mark_written(table, blk_num, nblks))
+		return -1; 
+
+	for (int i = 0; i < nblks; i++) {
+		bn = blk_num + i; 
+
+		/* The nonce never repeats for a key, every write takes a new 
+		   sequence number */
+		seq = __sync_fetch_and_add(&table->seal_seq, 1); 
+		memcpy(seal.iv, &seq, sizeof(seq)); 
+		memcpy(seal.iv + sizeof(seq), &bn, SEAL_IV_SIZE - sizeof(seq)); 
+
+		ret = sgx_rijndael128GCM_encrypt((const sgx_aes_gcm_128bit_key_t *)table->seal_key, 
+				(const uint8_t *)bufs[i], BLOCK_DATA_SIZE(bs), 
+				(uint8_t *)dst + (unsigned long)i * bs, 
+				seal.iv, SEAL_IV_SIZE, 
+				(const uint8_t *)&bn, sizeof(bn), 
+				(sgx_aes_gcm_128bit_tag_t *)seal.mac); 
+		if (ret != SGX_SUCCESS) {
+			ERR("sealing block %lu of %s failed:%x\n", bn, table->name.c_str(), ret); 
+			return -1; 
+		}
+
+		memcpy((char *)dst + (unsigned long)i * bs + BLOCK_DATA_SIZE(bs), 
+			&seal, sizeof(seal)); 
+
+#if defined(BLOCK_FRESHNESS)
+		if (merkle_update(table, bn, seal.mac))
+			return -1; 
+#endif
+	}
+	return 0; 
+}
+
+/* Decrypt and authenticate nblks blocks in place. They must already be 
+   copied into the enclave, so the host can't change the ciphertext 
+   after it is checked. Blocks that were never written come back as 
+   zeroes */
+int unseal_blocks(struct table *table, unsigned long blk_num, void **bufs, int nblks)
+{
+	static const block_seal_t hole = {}; 
+	unsigned long bs = table->db->bcache.blk_size; 
+	block_seal_t *seal; 
+	unsigned long bn; 
+	sgx_status_t ret; 
+
+	for (int i = 0; i < nblks; i++) {
+		bn = blk_num + i; 
+		seal = (block_seal_t *)((char *)bufs[i] + BLOCK_DATA_SIZE(bs)); 
+
+#if defined(BLOCK_FRESHNESS)
+		/* Only the last MAC written is fresh, a hole's zero MAC too */
+		if (merkle_verify(table, bn, seal->mac))
+			return -1; 
+#endif
+
+		if (!memcmp(seal, &hole, sizeof(hole))) {
+			/* A host that zeroes a seal mustn't be able to erase 
+			   the block */
+			if (seal_was_written(table, bn)) {
+				ERR("block %lu of %s lost its seal\n", bn, table->name.c_str()); 
+				return -1; 
+			}
+			memset(bufs[i], 0, BLOCK_DATA_SIZE(bs)); 
+			continue; 
+		}
+
+		ret = sgx_rijndael128GCM_decrypt((const sgx_aes_gcm_128bit_key_t *)table->seal_key, 
+				(const uint8_t *)bufs[i], BLOCK_DATA_SIZE(bs), 
+				(uint8_t *)bufs[i], 
+				seal->iv, SEAL_IV_SIZE, 
+				(const uint8_t *)&bn, sizeof(bn), 
+				(const sgx_aes_gcm_128bit_tag_t *)seal->mac); 
+		if (ret != SGX_SUCCESS) {
+			ERR("block %lu of %s failed authentication:%x\n", bn, table->name.c_str(), ret); 
+			return -1; 
+		}
+		DBG_ON(SEAL_VERBOSE, "unsealed block %lu of %s\n", bn, table->name.c_str()); 
+	}
+	return 0; 
+}
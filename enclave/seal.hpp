@@ -0,0 +1,35 @@
+#pragma once
+
+#include "bcache.hpp"
+#include "spinlock.hpp"
+
+/* Authenticated encryption of data blocks on disk. A block is sealed 
+   with AES-GCM under its table's key when it is staged for a write and 
+   unsealed after it is read. The nonce and MAC are kept in the last 
+   BLOCK_SEAL_SIZE bytes of the block, the block number is authenticated 
+   as additional data so blocks can't be moved around within the file. */
+
+#define SEAL_KEY_SIZE 16
+#define SEAL_IV_SIZE  12
+#define SEAL_MAC_SIZE 16
+
+typedef struct block_seal {
+	unsigned char iv[SEAL_IV_SIZE];  /* write sequence number, blk_num */
+	unsigned char pad[4];
+	unsigned char mac[SEAL_MAC_SIZE];
+} block_seal_t;
+
+/* Blocks of a table that were ever sealed. Only a block that never 
+   was may come back from disk without a seal, as a hole of zeroes */
+typedef struct seal_written {
+	struct spinlock lock; 
+	unsigned char *bits; 
+	unsigned long nblks; /* blocks bits has room for */
+} seal_written_t;
+
+struct table; 
+
+int seal_init(struct table *table);
+void seal_free(struct table *table);
+int seal_blocks(struct table *table, unsigned long blk_num, void **bufs, void *dst, int nblks);
+int unseal_blocks(struct table *table, unsigned long blk_num, void **bufs, int nblks);
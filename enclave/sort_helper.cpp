@@ -11,25 +11,22 @@
 
 #include <cerrno>
 
-void *get_element(table_t *tbl, int row_num, row_t *row_buf, int column)
+// *row points to a row buffer, on return it points to the row: in 
+// place if it is pinned, the buffer otherwise
+void *get_element(table_t *tbl, int row_num, row_t **row, int column)
 {
 	int ret;
+	data_block_t *b;
 	void *element;
 
-	if(tbl->pinned_blocks) {
-		data_block_t *b_i;
-		get_pinned_row(tbl, row_num, &b_i, &row_buf);
-	} else {
-		ret = read_row(tbl, row_num, row_buf);
-
-		if(ret) {
-			ERR("failed to read row %d of table %s\n",
-				row_num, tbl->name.c_str());
-			return NULL;
-		}
+	ret = get_pinned_row(tbl, row_num, &b, row);
+	if(ret) {
+		ERR("failed to read row %d of table %s\n",
+			row_num, tbl->name.c_str());
+		return NULL;
 	}
 
-	element = get_column(&tbl->sc, column, row_buf);
+	element = get_column(&tbl->sc, column, *row);
 	return element;
 }
 
@@ -37,7 +34,7 @@ int verify_sorted_output(table_t *tbl, int start, int end, int column)
 {
 	int ret = 0;
 	unsigned long i;
-	row_t *row_i, *row_j;
+	row_t *row_i, *row_j = NULL, *p_i, *p_j;
 
 	if (end > tbl->num_rows) {
 		end = tbl->num_rows;
@@ -52,19 +49,28 @@ int verify_sorted_output(table_t *tbl, int start, int end, int column)
 	row_j = (row_t *)malloc(row_size(tbl));
 	if (!row_j) {
 		ERR("can't allocate memory for the row\n");
-		return -ENOMEM;
+		ret = -ENOMEM;
+		goto exit;
 	}
 
-	// end is tbl->num_rows; we check until end - 2
-	for (i = start; i < end - 2; i++) {
-		void *element_i = get_element(tbl, i, row_i, column);
-		void *element_j = get_element(tbl, i + 1, row_j, column);
+	// Compare each row with the next one, up to the last pair
+	for (i = start; i + 1 < end; i++) {
+		p_i = row_i;
+		p_j = row_j;
+		void *element_i = get_element(tbl, i, &p_i, column);
+		void *element_j = get_element(tbl, i + 1, &p_j, column);
 		if (!element_i || !element_j) {
 			ERR("%s, failed\n", __func__);
 			ret = 1;
 			goto exit;
 		}
 
+		// Fake rows go after all real ones
+		if (p_i->header.fake || p_j->header.fake) {
+			ret |= (p_i->header.fake && !p_j->header.fake);
+			continue;
+		}
+
 		if (tbl->sc.types[column] == INTEGER) {
 			ret |= (*((int*)element_i) > *((int *)element_j));
 		} else if (tbl->sc.types[column] == TINYTEXT) {
@@ -72,26 +78,20 @@ int verify_sorted_output(table_t *tbl, int start, int end, int column)
 		}
 	}
 
+exit:
 	free(row_i);
 	free(row_j);
-exit:
 	return ret;
 }
 
-// INLINE procedure exchange() : pair swap
-int exchange(table_t *tbl, int i, int j, row_t *row_i, row_t *row_j, int tid) {
-	row_t *row_tmp;
+// Swap two rows in place in their blocks
+void swap_rows(table_t *tbl, row_handle_t *h_i, row_handle_t *h_j) {
 	row_t row_tmp_stack;
-	row_tmp = &row_tmp_stack;
 
-	memcpy(row_tmp, row_i, row_size(tbl));
+	memcpy(&row_tmp_stack, h_i->row, row_size(tbl));
+	memcpy(h_i->row, h_j->row, row_size(tbl));
+	memcpy(h_j->row, &row_tmp_stack, row_size(tbl));
 
-	if(tbl->pinned_blocks) {
-		memcpy(row_i, row_j, row_size(tbl));
-		memcpy(row_j, row_tmp, row_size(tbl));
-	} else {
-		write_row_dbg(tbl, row_j, i);
-		write_row_dbg(tbl, row_tmp, j);
-	}
-	return 0;
+	h_i->dirty = 1;
+	h_j->dirty = 1;
 }
@@ -1,8 +1,8 @@
 #ifndef _SORT_HELPER_H
 #define _SORT_HELPER_H
 
-void *get_element(table_t *tbl, int row_num, row_t *row_buf, int column);
+void *get_element(table_t *tbl, int row_num, row_t **row, int column);
 int verify_sorted_output(table_t *tbl, int start, int end, int column);
-int exchange(table_t *tbl, int i, int j, row_t *row_i, row_t *row_j, int tid);
+void swap_rows(table_t *tbl, row_handle_t *h_i, row_handle_t *h_j);
 
 #endif // _SORT_HELPER_H
@@ -41,6 +41,22 @@ void acquire(struct spinlock *lk)
 #endif
 }
 
+// Try to acquire the lock once without spinning.
+// Returns 1 if the lock was acquired, 0 if it is held by someone else.
+int tryacquire(struct spinlock *lk)
+{
+	if(xchg(&lk->locked, 1) != 0)
+		return 0;
+
+	__sync_synchronize();
+
+#if defined(DEBUG_SPINLOCKS)
+	lk->cpu = mycpu();
+	getcallerpcs(&lk, lk->pcs);
+#endif
+	return 1;
+}
+
 // Release the lock.
 void release(struct spinlock *lk)
 {
@@ -17,6 +17,7 @@ struct spinlock {
 
 void initlock(struct spinlock *lk, std::string name);
 void acquire(struct spinlock *lk);
+int tryacquire(struct spinlock *lk);
 void release(struct spinlock *lk);
 
 typedef struct {
@@ -9,6 +9,7 @@
 #include "db.hpp"
 #include <cassert>
 #include <string.h>
+#include <cerrno>
 #include "column_sort.hpp"
 using namespace std;
 
@@ -499,3 +500,36 @@ void ecall_obli_swap_tests() {
 
 	return;
 }
+
+/* Freshness benchmark: write the table back and drop its blocks from 
+   the cache, so that the next scan reads every block from disk. Prints 
+   the tree stats since the last call. The checks can't be turned off, 
+   the baseline is a build without BLOCK_FRESHNESS */
+int ecall_merkle_scan_setup(int db_id, int table_id) {
+#if defined(TEST_FRESHNESS)
+	data_base_t *db;
+	table_t *table;
+	merkle_stats_t stats; 
+
+	if (!(db = get_db(db_id)))
+		return -1;
+
+	if ((table_id > (MAX_TABLES - 1)) || !db->tables[table_id])
+		return -2; 
+
+	table = db->tables[table_id];
+
+	if (bflush(table))
+		return -3; 
+	binval(table); 
+
+	if (table->merkle) {
+		merkle_stats_read_and_reset(table, &stats); 
+		printf("merkle %s: verifies:%lu, updates:%lu, nodes hashed:%lu, node cache hits:%lu\n", 
+			table->name.c_str(), stats.verifies, stats.updates, stats.hashes, stats.cache_hits); 
+	}
+	return 0; 
+#else
+	return -ENOSYS; 
+#endif
+}
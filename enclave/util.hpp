@@ -123,6 +123,13 @@ _mm_store_pd (double *__P, __m128d __A)
   *(__m128d *)__P = __A;
 }
 
+/* Spin-wait hint, from xmmintrin.h */
+extern __inline void __attribute__((__gnu_inline__, __always_inline__, __artificial__))
+_mm_pause (void)
+{
+  __builtin_ia32_pause ();
+}
+
 
 #if 0
 template <typename T>
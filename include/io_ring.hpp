@@ -0,0 +1,65 @@
+#pragma once
+
+/* Exitless block I/O. Instead of an ocall, an enclave thread posts a
+   pread/pwrite request into a slot of a ring that lives in untrusted
+   memory and spins until an untrusted worker thread marks it done.
+   If no worker picks the request up in time, the enclave takes it
+   back and uses an ocall. Every enclave I/O thread owns the slot
+   indexed by its tid, so posting a request needs no locking. */
+
+#define IO_RING_SLOTS 16 /* must be >= IO_THREADS_PER_DB */
+#define IO_RING_WORKERS 2
+#define IO_RING_SPIN 1000 /* idle scans before a worker yields the CPU */
+#define IO_RING_WAIT (1 << 20) /* spins before an enclave thread gives up on the workers */
+
+#define IO_SLOT_FREE      0
+#define IO_SLOT_SUBMITTED 1
+#define IO_SLOT_BUSY      2 /* claimed by a worker */
+#define IO_SLOT_DONE      3
+
+#define IO_OP_READ  0
+#define IO_OP_WRITE 1
+
+typedef struct io_slot {
+	volatile int state;
+	int op;
+	int fd;
+	void *buf;
+	unsigned long size;
+	unsigned long offset;
+	volatile long result; /* bytes transferred or < 0 */
+} __attribute__((aligned(64))) io_slot_t;
+
+typedef struct io_ring {
+	io_slot_t slots[IO_RING_SLOTS];
+	volatile int stop;
+} io_ring_t;
+
+/* Untrusted side (app/io_ring.cpp) */
+io_ring_t *io_ring_start(int num_workers);
+void io_ring_stop(io_ring_t *ring);
+
+/* Asynchronous batched block I/O (app/aio.cpp). The enclave hands a 
+   batch of requests to the untrusted AIO service in one crossing and 
+   reaps their completions later with another. Each enclave I/O thread 
+   uses its own AIO context, indexed by tid. A pool of worker threads 
+   services the requests of all contexts. */
+
+#define IO_AIO_CTXS  16 /* must be >= IO_THREADS_PER_DB */
+#define IO_AIO_DEPTH 64 /* max requests in flight per context */
+#define IO_AIO_WORKERS 4
+#define IO_AIO_READ_SPLIT IO_AIO_WORKERS /* requests a read-ahead window is split into */
+
+typedef struct io_req {
+	int op;   /* IO_OP_READ or IO_OP_WRITE */
+	int fd;
+	void *buf; /* untrusted staging memory */
+	unsigned long size;
+	unsigned long offset;
+	unsigned long id; /* returned in the completion */
+} io_req_t;
+
+typedef struct io_cpl {
+	unsigned long id;
+	long result; /* bytes transferred or < 0 */
+} io_cpl_t;